@@ -0,0 +1,51 @@
+#!/bin/bash
+# Usage: ./blockbench.sh [block_sizes...]
+# Compares sequential and small-file throughput of RAID 1 across block sizes
+# (default 512 4096 65536). Each size gets two fresh disks; reads and writes
+# bypass the page cache (direct_io) so wfs itself is measured.
+
+SIZES=${*:-"512 4096 65536"}
+MNT=blockbench_mnt
+DISKS="blockbench_disk1 blockbench_disk2"
+SEQ_MB=16         # Sequential file size
+SMALL_FILES=500   # Small files of 4 KiB each
+
+now() { date +%s.%N; }
+rate() { awk -v n="$1" -v a="$2" -v b="$3" 'BEGIN { printf "%.1f", n / (b - a) }'; }
+
+mkdir -p $MNT
+printf "%8s %14s %14s %16s\n" "block" "seq write MB/s" "seq read MB/s" "small files/s"
+for BS in $SIZES; do
+    MKFS_DISKS=""
+    for d in $DISKS; do
+        dd if=/dev/zero of=$d bs=1M count=64 status=none
+        MKFS_DISKS="$MKFS_DISKS -d $d"
+    done
+    ./mkfs -r 1 $MKFS_DISKS -i 1024 -b $((40 * 1024 * 1024 / BS)) -B $BS || exit 1
+    ./wfs $DISKS -o direct_io $MNT || exit 1
+
+    START=$(now)
+    dd if=/dev/zero of=$MNT/seq bs=128k count=$((SEQ_MB * 8)) conv=fsync status=none
+    END=$(now)
+    WRITE=$(rate $SEQ_MB $START $END)
+
+    START=$(now)
+    dd if=$MNT/seq of=/dev/null bs=128k status=none
+    END=$(now)
+    READ=$(rate $SEQ_MB $START $END)
+
+    mkdir $MNT/small
+    START=$(now)
+    for i in $(seq 1 $SMALL_FILES); do
+        head -c 4096 /dev/zero > $MNT/small/f$i
+    done
+    sync
+    END=$(now)
+    SMALL=$(rate $SMALL_FILES $START $END)
+
+    printf "%8s %14s %14s %16s\n" $BS $WRITE $READ $SMALL
+    fusermount -u $MNT
+done
+
+rm -f $DISKS
+rmdir $MNT
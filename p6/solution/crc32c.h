@@ -0,0 +1,66 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC32C (Castagnoli) for the RAID 1v block checksums. Uses the SSE4.2 crc32
+// instruction when the CPU has it and a lookup table otherwise; both give the
+// same result. Call crc32c_init once before any other thread starts.
+
+static uint32_t crc32c_table[256];
+static int crc32c_use_hw = 0;
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static inline void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static inline uint32_t crc32c(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+#if defined(__x86_64__)
+    if (crc32c_use_hw) {
+        return ~crc32c_hw(~0U, p, len);
+    }
+#endif
+    return ~crc32c_sw(~0U, p, len);
+}
+
+#endif // CRC32C_H
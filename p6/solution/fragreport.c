@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include "wfs.h"
+
+// Prints how fragmented each regular file on a wfs image is.
+// Usage: ./fragreport disk1 [disk2 ...]   (all disks, in mount order)
+// A run is a stretch of file blocks stored in consecutive data blocks; the
+// longer the average run, the fewer separate copies a read or write needs.
+
+static struct wfs_sb superblock;
+static char *disk_maps[MAX_DISKS];
+static int num_disks = 0;
+static int block_size = BLOCK_SIZE;
+static int n_ptr = INDIRECT_BLOCK_ENTRIES;
+
+int get_bit(char *bitmap, int index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+// Same placement as raid0_copy and raid5_locate in wfs.c
+static char *block_ptr(off_t block_number) {
+    int stripe_blocks = superblock.stripe_blocks > 0 ? superblock.stripe_blocks : 1;
+    if (superblock.raid_mode == 3) {
+        off_t unit = block_number / stripe_blocks;
+        int data_disks = num_disks - 1;
+        int k = unit % data_disks;
+        off_t stripe = unit / data_disks;
+        int parity_disk = num_disks - 1 - stripe % num_disks;
+        int disk_idx = k < parity_disk ? k : k + 1;
+        off_t disk_block = stripe * stripe_blocks + block_number % stripe_blocks;
+        return disk_maps[disk_idx] + superblock.d_blocks_ptr + disk_block * block_size;
+    }
+    if (superblock.raid_mode == 0) {
+        off_t unit = block_number / stripe_blocks;
+        int disk_idx = unit % num_disks;
+        off_t disk_block = (unit / num_disks) * stripe_blocks + block_number % stripe_blocks;
+        return disk_maps[disk_idx] + superblock.d_blocks_ptr + disk_block * block_size;
+    }
+    return disk_maps[0] + superblock.d_blocks_ptr + block_number * block_size;
+}
+
+// Appends the data blocks under a pointer block levels deep to blocks[*n].
+// Returns 0 once a hole is reached.
+static int tree_blocks(off_t block, int levels, off_t *blocks, int *n) {
+    off_t *pointers = (off_t *) block_ptr(block);
+    for (int i = 0; i < n_ptr; i++) {
+        if (pointers[i] == 0) return 0;
+        if (levels > 1) {
+            if (!tree_blocks(pointers[i], levels - 1, blocks, n)) return 0;
+        } else {
+            blocks[(*n)++] = pointers[i];
+        }
+    }
+    return 1;
+}
+
+// Collects the data blocks of a file in file order, stopping at the first hole
+static int file_blocks(struct wfs_inode *inode, off_t *blocks) {
+    int n = 0;
+    for (int i = 0; i < D_BLOCK && inode->blocks[i] != 0; i++) {
+        blocks[n++] = inode->blocks[i];
+    }
+    if (n == D_BLOCK && inode->blocks[IND_BLOCK] != 0 && tree_blocks(inode->blocks[IND_BLOCK], 1, blocks, &n) &&
+        (superblock.features & WFS_FEATURE_LARGE_FILE) && inode->dind_block != 0 &&
+        tree_blocks(inode->dind_block, 2, blocks, &n) && inode->tind_block != 0) {
+        tree_blocks(inode->tind_block, 3, blocks, &n);
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc - 1 > MAX_DISKS) {
+        fprintf(stderr, "Usage: %s disk1 [disk2 ...]\n", argv[0]);
+        return 1;
+    }
+
+    num_disks = argc - 1;
+    for (int i = 0; i < num_disks; i++) {
+        int fd = open(argv[i + 1], O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "[ERROR] main: Failed to open disk '%s': %s\n", argv[i + 1], strerror(errno));
+            return 1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            fprintf(stderr, "[ERROR] main: fstat failed for disk '%s': %s\n", argv[i + 1], strerror(errno));
+            return 1;
+        }
+        disk_maps[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (disk_maps[i] == MAP_FAILED) {
+            fprintf(stderr, "[ERROR] main: mmap failed for disk '%s': %s\n", argv[i + 1], strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+
+    memcpy(&superblock, disk_maps[0], sizeof(struct wfs_sb));
+    if (superblock.num_disks != num_disks) {
+        fprintf(stderr, "[ERROR] main: Expected %d disks, got %d.\n", superblock.num_disks, num_disks);
+        return 1;
+    }
+    if (superblock.features & WFS_FEATURE_BLOCK_SIZE) {
+        block_size = superblock.block_size;
+        n_ptr = block_size / sizeof(off_t);
+    }
+
+    // A file cannot have more blocks than the image
+    off_t *blocks = malloc(superblock.num_data_blocks * sizeof(off_t));
+    if (blocks == NULL) {
+        fprintf(stderr, "[ERROR] main: Out of memory.\n");
+        return 1;
+    }
+    long total_blocks = 0, total_runs = 0;
+    int files = 0;
+
+    printf("%6s %10s %7s %5s %8s\n", "inode", "size", "blocks", "runs", "avg_run");
+    for (int i = 0; i < (int) superblock.num_inodes; i++) {
+        if (!get_bit(disk_maps[0] + superblock.i_bitmap_ptr, i)) continue;
+
+        struct wfs_inode inode;
+        memcpy(&inode, disk_maps[0] + superblock.i_blocks_ptr + i * INODE_SIZE, sizeof(struct wfs_inode));
+        if (!S_ISREG(inode.mode)) continue;
+
+        int n = file_blocks(&inode, blocks);
+        if (n == 0) continue;
+        int runs = 1;
+        for (int b = 1; b < n; b++) {
+            if (blocks[b] != blocks[b - 1] + 1) runs++;
+        }
+        printf("%6d %10ld %7d %5d %8.2f\n", i, (long) inode.size, n, runs, (double) n / runs);
+
+        files++;
+        total_blocks += n;
+        total_runs += runs;
+    }
+
+    if (files == 0) {
+        printf("No regular files with data.\n");
+        return 0;
+    }
+    printf("%d files, %ld blocks, %ld runs, average run length %.2f blocks\n",
+           files, total_blocks, total_runs, (double) total_blocks / total_runs);
+    return 0;
+}
@@ -9,9 +9,9 @@
 #include <sys/types.h>
 #include <time.h>
 #include "wfs.h" 
+#include "crc32c.h"
 
 #define MAX_DISKS 10
-#define INODE_SIZE 512
 #define BITS_PER_BYTE 8
 
 // Helper functions
@@ -48,8 +48,11 @@ int main(int argc, char *argv[]) {
     int num_disks = 0;
     int num_inodes = -1;
     int num_data_blocks = -1;
+    int stripe_size = 0;   // Defaults to one block
+    int journal_blocks = -1;
+    int block_size = BLOCK_SIZE;
 
-    while ((opt = getopt(argc, argv, "r:d:i:b:")) != -1) {
+    while ((opt = getopt(argc, argv, "r:d:i:b:s:j:B:")) != -1) {
         switch (opt) {
             case 'r':
                 if (strcmp(optarg, "0") == 0)
@@ -58,6 +61,8 @@ int main(int argc, char *argv[]) {
                     raid_mode = 1;
                 else if (strcmp(optarg, "1v") == 0)
                     raid_mode = 2; // Use 2 to represent RAID 1v
+                else if (strcmp(optarg, "5") == 0)
+                    raid_mode = 3; // Use 3 to represent RAID 5
                 else {
                     fprintf(stderr, "Invalid RAID mode.\n");
                     return 1;
@@ -84,8 +89,29 @@ int main(int argc, char *argv[]) {
                     return 1;
                 }
                 break;
+            case 's':
+                stripe_size = atoi(optarg);
+                if (stripe_size <= 0) {
+                    fprintf(stderr, "Invalid stripe size.\n");
+                    return 1;
+                }
+                break;
+            case 'j':
+                journal_blocks = atoi(optarg);
+                if (journal_blocks != 0 && journal_blocks < 16) {
+                    fprintf(stderr, "Invalid journal size (0 for none, otherwise at least 16 blocks).\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                block_size = atoi(optarg);
+                if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+                    fprintf(stderr, "Invalid block size (a power of two from %d to %d bytes).\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                    return 1;
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -r [0|1|1v] -d disk1 -d disk2 ... -i num_inodes -b num_blocks\n", argv[0]);
+                fprintf(stderr, "Usage: %s -r [0|1|1v|5] -d disk1 -d disk2 ... -i num_inodes -b num_blocks [-s stripe_bytes] [-j journal_blocks] [-B block_bytes]\n", argv[0]);
                 return 1;
         }
     }
@@ -119,6 +145,9 @@ int main(int argc, char *argv[]) {
         case 2: // RAID 1v
             min_disks_required = 2;
             break;
+        case 3: // RAID 5
+            min_disks_required = 3;
+            break;
         default:
             fprintf(stderr, "Invalid RAID mode.\n");
             return 1;
@@ -136,6 +165,27 @@ int main(int argc, char *argv[]) {
     // Round up data blocks
     num_data_blocks = round_up_blocks(num_data_blocks);
 
+    // A stripe unit must fit in each disk's share of the data blocks
+    if (stripe_size == 0) {
+        stripe_size = block_size;
+    }
+    if (stripe_size % block_size != 0) {
+        fprintf(stderr, "Invalid stripe size (must be a multiple of %d bytes).\n", block_size);
+        return 1;
+    }
+    int stripe_blocks = stripe_size / block_size;
+    if (stripe_blocks > num_data_blocks / num_disks) {
+        fprintf(stderr, "Error: Stripe size too large for %d data blocks.\n", num_data_blocks);
+        return 1;
+    }
+
+    // The journal defaults to an eighth of the data blocks, within 64..2048
+    if (journal_blocks < 0) {
+        journal_blocks = num_data_blocks / 8;
+        if (journal_blocks < 64) journal_blocks = 64;
+        if (journal_blocks > 2048) journal_blocks = 2048;
+    }
+
     // Calculate sizes
     size_t superblock_size = sizeof(struct wfs_sb);
     size_t offset = 0;
@@ -167,11 +217,37 @@ int main(int argc, char *argv[]) {
     size_t inode_region_size = num_inodes * INODE_SIZE;
     offset += inode_region_size;
 
+    // Data blocks start on a block boundary. wfs maps the metadata privately
+    // when journaling, so then it must also end on a page boundary.
+    size_t data_align = block_size;
+    if (journal_blocks > 0 && data_align < WFS_META_ALIGN) {
+        data_align = WFS_META_ALIGN;
+    }
+    if (offset % data_align != 0) {
+        offset += data_align - (offset % data_align);
+    }
+
     // Data blocks region
     off_t d_blocks_ptr = offset;
-    size_t data_region_size = num_data_blocks * BLOCK_SIZE;
+    size_t data_region_size = wfs_disk_data_blocks(num_data_blocks, raid_mode, num_disks, stripe_blocks) * block_size;
     offset += data_region_size;
 
+    // RAID 1v checksum region, one CRC32C per data block
+    off_t csum_ptr = offset;
+    if (raid_mode == 2) {
+        offset += num_data_blocks * sizeof(uint32_t);
+    }
+
+    // Metadata journal
+    off_t journal_ptr = 0;
+    if (journal_blocks > 0) {
+        if (offset % block_size != 0) {
+            offset += block_size - (offset % block_size);
+        }
+        journal_ptr = offset;
+        offset += (size_t) journal_blocks * block_size;
+    }
+
     size_t fs_size = offset;
 
     // Map disks
@@ -220,6 +296,18 @@ int main(int argc, char *argv[]) {
     superblock.d_blocks_ptr = d_blocks_ptr;
     superblock.raid_mode = raid_mode;
     superblock.num_disks = num_disks;
+    superblock.stripe_blocks = stripe_blocks;
+    if (raid_mode == 2) {
+        superblock.features |= WFS_FEATURE_CSUM;
+    }
+    if (journal_blocks > 0) {
+        superblock.features |= WFS_FEATURE_JOURNAL;
+        superblock.journal_ptr = journal_ptr;
+        superblock.journal_blocks = journal_blocks;
+    }
+    superblock.features |= WFS_FEATURE_DIR_INDEX | WFS_FEATURE_LARGE_FILE | WFS_FEATURE_BLOCK_SIZE |
+                           WFS_FEATURE_INLINE_DATA | WFS_FEATURE_BLOCK_COUNT;
+    superblock.block_size = block_size;
 
     // **Add Initialization of disk_order with Unique Disk IDs**
     for (int i = 0; i < num_disks; i++) {
@@ -278,6 +366,31 @@ int main(int argc, char *argv[]) {
         memcpy(inode_ptr, &root_inode, sizeof(struct wfs_inode));
     }
 
+    // RAID 5 parity starts out consistent with all-zero data
+    if (raid_mode == 3) {
+        for (int i = 0; i < num_disks; i++) {
+            memset(disk_maps[i] + d_blocks_ptr, 0, data_region_size);
+        }
+    }
+
+    // Checksum every data block as it currently is on each disk
+    if (raid_mode == 2) {
+        crc32c_init();
+        for (int i = 0; i < num_disks; i++) {
+            uint32_t *csums = (uint32_t *)(disk_maps[i] + csum_ptr);
+            for (int b = 0; b < num_data_blocks; b++) {
+                csums[b] = crc32c(disk_maps[i] + d_blocks_ptr + (off_t) b * block_size, block_size);
+            }
+        }
+    }
+
+    // An all-zero journal holds no transaction
+    if (journal_blocks > 0) {
+        for (int i = 0; i < num_disks; i++) {
+            memset(disk_maps[i] + journal_ptr, 0, (size_t) journal_blocks * block_size);
+        }
+    }
+
     // Clean up
     for (int i = 0; i < num_disks; i++) {
         munmap(disk_maps[i], fs_size);
@@ -0,0 +1,25 @@
+#!/bin/bash
+# Usage: ./raidbench.sh [max_threads] [seconds]
+# Compares write throughput of RAID 1 and RAID 5 on three fresh disks.
+
+THREADS=${1:-4}
+SECONDS_PER_RUN=${2:-5}
+MNT=raidbench_mnt
+DISKS="raidbench_disk1 raidbench_disk2 raidbench_disk3"
+
+mkdir -p $MNT
+for RAID in 1 5; do
+    MKFS_DISKS=""
+    for d in $DISKS; do
+        dd if=/dev/zero of=$d bs=1M count=10 status=none
+        MKFS_DISKS="$MKFS_DISKS -d $d"
+    done
+    ./mkfs -r $RAID $MKFS_DISKS -i 256 -b 4096 || exit 1
+    ./wfs $DISKS $MNT || exit 1
+    echo "RAID $RAID writes:"
+    ./stress $MNT $THREADS $SECONDS_PER_RUN write
+    fusermount -u $MNT
+done
+
+rm -f $DISKS
+rmdir $MNT
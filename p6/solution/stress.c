@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Parallel reader/writer load against a mounted wfs.
+// Usage: ./stress <mountpoint> [max_threads] [seconds] [mixed|write|read]
+// In the default mixed mode even-numbered threads write 4 KiB chunks into
+// their own file and odd-numbered threads read 4 KiB chunks from a shared
+// file; write and read make every thread a writer or a reader. The run is
+// repeated for 1, 2, 4, ... max_threads threads and ops/sec is printed for
+// each.
+
+#define FILE_SIZE (32 * 1024)   // Fits in the direct + single indirect range
+#define IO_SIZE 4096
+#define MAX_THREADS 64
+
+#define MODE_MIXED 0
+#define MODE_WRITE 1
+#define MODE_READ  2
+
+static const char *mountpoint;
+static int mode = MODE_MIXED;
+static volatile int stop;
+
+struct worker {
+    pthread_t tid;
+    int id;
+    long ops;
+    long errors;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill_file(const char *path) {
+    char buf[IO_SIZE];
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] fill_file: open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    memset(buf, 'r', sizeof(buf));
+    for (off_t off = 0; off < FILE_SIZE; off += IO_SIZE) {
+        if (pwrite(fd, buf, IO_SIZE, off) != IO_SIZE) {
+            fprintf(stderr, "[ERROR] fill_file: write %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    char path[4096], buf[IO_SIZE];
+    unsigned int seed = w->id * 7919 + 1;
+    int writer = mode == MODE_MIXED ? (w->id % 2) == 0 : mode == MODE_WRITE;
+    int fd;
+
+    if (writer) {
+        snprintf(path, sizeof(path), "%s/stress_w%d", mountpoint, w->id);
+        fd = open(path, O_CREAT | O_RDWR, 0644);
+    } else {
+        snprintf(path, sizeof(path), "%s/stress_shared", mountpoint);
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] worker %d: open %s: %s\n", w->id, path, strerror(errno));
+        w->errors++;
+        return NULL;
+    }
+
+    memset(buf, 'a' + w->id % 26, sizeof(buf));
+    while (!stop) {
+        off_t off = (rand_r(&seed) % (FILE_SIZE / IO_SIZE)) * IO_SIZE;
+        ssize_t ret = writer ? pwrite(fd, buf, IO_SIZE, off) : pread(fd, buf, IO_SIZE, off);
+        if (ret != IO_SIZE) {
+            w->errors++;
+        } else {
+            w->ops++;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int run(int nthreads, int seconds) {
+    struct worker workers[MAX_THREADS];
+    long ops = 0, errors = 0;
+    double start, elapsed;
+
+    memset(workers, 0, sizeof(workers));
+    stop = 0;
+    start = now();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "[ERROR] run: pthread_create failed\n");
+            stop = 1;
+            nthreads = i;
+            break;
+        }
+    }
+    sleep(seconds);
+    stop = 1;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        ops += workers[i].ops;
+        errors += workers[i].errors;
+    }
+    elapsed = now() - start;
+
+    printf("%7d %12ld %12.0f %8ld\n", nthreads, ops, ops / elapsed, errors);
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    char path[4096];
+    int max_threads = 8;
+    int seconds = 5;
+    int status = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <mountpoint> [max_threads] [seconds] [mixed|write|read]\n", argv[0]);
+        return 1;
+    }
+    mountpoint = argv[1];
+    if (argc > 2) max_threads = atoi(argv[2]);
+    if (argc > 3) seconds = atoi(argv[3]);
+    if (argc > 4) {
+        if (strcmp(argv[4], "write") == 0) {
+            mode = MODE_WRITE;
+        } else if (strcmp(argv[4], "read") == 0) {
+            mode = MODE_READ;
+        } else if (strcmp(argv[4], "mixed") != 0) {
+            fprintf(stderr, "[ERROR] main: Unknown mode '%s'\n", argv[4]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || seconds < 1) {
+        fprintf(stderr, "[ERROR] main: threads must be 1..%d and seconds >= 1\n", MAX_THREADS);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/stress_shared", mountpoint);
+    if (fill_file(path) != 0) {
+        return 1;
+    }
+
+    printf("%7s %12s %12s %8s\n", "threads", "ops", "ops/sec", "errors");
+    for (int n = 1; ; n *= 2) {
+        if (n > max_threads) n = max_threads;
+        if (run(n, seconds) != 0) status = 1;
+        if (n == max_threads) break;
+    }
+    return status;
+}
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Usage: ./stress.sh [raid_mode] [max_threads] [seconds]
+# Formats two fresh disks, mounts wfs multithreaded and runs ./stress on it.
+
+RAID=${1:-1}
+THREADS=${2:-8}
+SECONDS_PER_RUN=${3:-5}
+MNT=stress_mnt
+
+dd if=/dev/zero of=stress_disk1 bs=1M count=10 status=none
+dd if=/dev/zero of=stress_disk2 bs=1M count=10 status=none
+./mkfs -r $RAID -d stress_disk1 -d stress_disk2 -i 256 -b 4096 || exit 1
+
+mkdir -p $MNT
+./wfs stress_disk1 stress_disk2 $MNT || exit 1
+./stress $MNT $THREADS $SECONDS_PER_RUN
+STATUS=$?
+
+fusermount -u $MNT
+rm -f stress_disk1 stress_disk2
+rmdir $MNT
+exit $STATUS
@@ -0,0 +1,157 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// Leveled tracing for wfs. TRACE(level, fmt, ...) records an event in a
+// lock-free ring of the last TRACE_RING_SLOTS events; events at TRACE_INFO
+// and below are also written to stderr as they happen. Levels above
+// WFS_TRACE_LEVEL (set at build time, default TRACE_INFO) compile to
+// nothing, arguments included, and trace_level (the trace=N mount option)
+// filters the rest at run time. SIGUSR1 writes the ring out to trace_fd;
+// a thread does the writing, so the handler itself only posts a semaphore.
+
+#define TRACE_ERROR 1
+#define TRACE_INFO  2
+#define TRACE_DEBUG 3
+
+#ifndef WFS_TRACE_LEVEL
+#define WFS_TRACE_LEVEL TRACE_INFO
+#endif
+
+#define TRACE_RING_SLOTS 2048
+#define TRACE_MSG_MAX    240
+
+#define TRACE(level, ...) do { \
+        if ((level) <= WFS_TRACE_LEVEL && (level) <= trace_level) { \
+            trace_event((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+// A slot's seq is 0 while it is being written and the event's sequence
+// number + 1 once it is complete; a reader that sees it change while copying
+// the slot skips the event
+struct trace_slot {
+    uint64_t seq;
+    uint64_t ns;
+    int level;
+    char msg[TRACE_MSG_MAX];
+};
+
+static int trace_level = WFS_TRACE_LEVEL;
+static int trace_fd = STDERR_FILENO;
+static struct trace_slot trace_ring[TRACE_RING_SLOTS];
+static uint64_t trace_next = 0;
+static sem_t trace_dump_sem;
+static int trace_stopping = 0;
+static pthread_t trace_thread;
+static int trace_thread_running = 0;
+
+static const char *const trace_names[] = { "NONE", "ERROR", "INFO", "DEBUG" };
+
+__attribute__((format(printf, 2, 3)))
+static void trace_event(int level, const char *fmt, ...) {
+    char msg[TRACE_MSG_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t seq = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    struct trace_slot *slot = &trace_ring[seq % TRACE_RING_SLOTS];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    slot->level = level;
+    memcpy(slot->msg, msg, sizeof(msg));
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+
+    if (level <= TRACE_INFO) {
+        fprintf(stderr, "[%s] %s\n", trace_names[level], msg);
+    }
+}
+
+// Writes every complete event still in the ring to fd, oldest first
+static void trace_dump(int fd) {
+    uint64_t end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t start = end > TRACE_RING_SLOTS ? end - TRACE_RING_SLOTS : 0;
+    char line[TRACE_MSG_MAX + 64];
+    for (uint64_t seq = start; seq < end; seq++) {
+        struct trace_slot *slot = &trace_ring[seq % TRACE_RING_SLOTS];
+        struct trace_slot copy;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1) continue;
+        memcpy(&copy, slot, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1) continue;
+        copy.msg[TRACE_MSG_MAX - 1] = '\0';
+
+        int len = snprintf(line, sizeof(line), "%" PRIu64 ".%09" PRIu64 " [%s] %s\n",
+                           copy.ns / 1000000000, copy.ns % 1000000000,
+                           trace_names[copy.level], copy.msg);
+        if (len > (int) sizeof(line) - 1) len = sizeof(line) - 1;
+        if (write(fd, line, len) < 0) return;
+    }
+}
+
+static void trace_signal(int sig) {
+    (void) sig;
+    int saved = errno;
+    sem_post(&trace_dump_sem);
+    errno = saved;
+}
+
+static void *trace_main(void *arg) {
+    (void) arg;
+    for (;;) {
+        while (sem_wait(&trace_dump_sem) != 0 && errno == EINTR) {
+        }
+        if (__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        trace_dump(trace_fd);
+    }
+    return NULL;
+}
+
+// Starts the dump thread and hooks up SIGUSR1. Called from wfs_init, after
+// FUSE has daemonized.
+static void trace_start(void) {
+    sem_init(&trace_dump_sem, 0, 0);
+    if (pthread_create(&trace_thread, NULL, trace_main, NULL) != 0) {
+        TRACE(TRACE_ERROR, "trace_start: Failed to start the dump thread, SIGUSR1 is ignored");
+        return;
+    }
+    trace_thread_running = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void trace_stop(void) {
+    if (!trace_thread_running) {
+        return;
+    }
+    signal(SIGUSR1, SIG_IGN);
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&trace_dump_sem);
+    pthread_join(trace_thread, NULL);
+    trace_thread_running = 0;
+}
+
+#endif // TRACE_H
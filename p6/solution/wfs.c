@@ -7,17 +7,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include "wfs.h"
+#include "crc32c.h"
+#include "trace.h"
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <libgen.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
-#define INODE_SIZE 512
 #define BITS_PER_BYTE 8
 
 static struct wfs_sb superblock;
@@ -28,6 +32,34 @@ static uint64_t num_inodes = 0;
 static uint64_t num_data_blocks = 0;
 static size_t fs_size = 0;
 static int fd_disks[MAX_DISKS];
+static int block_size = BLOCK_SIZE;   // From the superblock, see main
+static int ptrs_per_block = INDIRECT_BLOCK_ENTRIES;  // Block numbers per pointer block
+
+// Locking
+//
+// wfs runs under libfuse's multithreaded loop. Every inode has a
+// reader/writer lock; a directory is write-locked while its entries change
+// and read-locked while it is searched. Inode locks are always taken parent
+// before child. The bitmaps, the dentry cache and the open file table each
+// have a mutex that is only held for short leaf operations.
+static pthread_rwlock_t *inode_locks;
+// Lowest possibly free slot of each linear directory, see dir_find_hole
+static int *dir_free_hint;
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void inode_rdlock(int inode_num) {
+    pthread_rwlock_rdlock(&inode_locks[inode_num]);
+}
+
+static void inode_wrlock(int inode_num) {
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
+}
+
+static void inode_unlock(int inode_num) {
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+}
 
 // Helper functions
 int get_bit(char *bitmap, int index) {
@@ -42,339 +74,3286 @@ void clear_bit(char *bitmap, int index) {
     bitmap[index / 8] &= ~(1 << (index % 8));
 }
 
-// Debug print methods
-void print_superblock() {
-    printf("[DEBUG] Superblock Information:\n");
-    printf("Raid Mode: %d\n", superblock.raid_mode);
-    printf("Number of Inodes: %" PRIu64 "\n", superblock.num_inodes);
-    printf("Number of Data Blocks: %" PRIu64 "\n", superblock.num_data_blocks);
-    printf("Number of Disks: %d\n", superblock.num_disks);
-    printf("Inode Bitmap Pointer: %" PRIu64 "\n", superblock.i_bitmap_ptr);
-    printf("Data Bitmap Pointer: %" PRIu64 "\n", superblock.d_bitmap_ptr);
-    printf("Inode Blocks Pointer: %" PRIu64 "\n", superblock.i_blocks_ptr);
-    printf("Data Blocks Pointer: %" PRIu64 "\n", superblock.d_blocks_ptr);
-}
-
-void dump_data_bitmap_comparison() {
-    char *data_bitmap0 = disk_maps[0] + superblock.d_bitmap_ptr;
-    int total_blocks = superblock.num_data_blocks;
-
-    for (int d = 1; d < num_disks; d++) {
-        char *data_bitmap_d = disk_maps[d] + superblock.d_bitmap_ptr;
-        for (int i = 0; i < total_blocks; i++) {
-            if (get_bit(data_bitmap0, i) != get_bit(data_bitmap_d, i)) {
-                fprintf(stderr, "[ERROR] dump_data_bitmap_comparison: Mismatch at block %d between disk 0 and disk %d\n", i, d);
-            }
+// Absolute CLOCK_REALTIME time ms milliseconds from now, for timed waits
+static void deadline_after_ms(struct timespec *deadline, int ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Statistics
+//
+// Every FUSE operation is timed and counted, with latencies kept in
+// log-scale histograms: bucket b counts values in [2^(b-1), 2^b), bucket 0
+// counts zeroes. The data path counts reads and writes per disk, and each
+// bitmap allocation records how many 64-bit words it scanned. All counters
+// are updated with relaxed atomics and read without locks, so a report may
+// be a few events out of step with itself. The report can be read from
+// STATS_PATH and is traced at unmount.
+#define STAT_BUCKETS 64
+#define STATS_PATH "/.wfs_stats"
+
+struct stat_hist {
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[STAT_BUCKETS];
+};
+
+enum {
+    OP_GETATTR, OP_MKNOD, OP_MKDIR, OP_UNLINK, OP_RMDIR, OP_READ, OP_WRITE, OP_READDIR,
+    OP_OPEN, OP_CREATE, OP_RELEASE, OP_FALLOCATE, OP_FSYNC, OP_FLUSH, OP_FSYNCDIR,
+    OP_TRUNCATE, OP_FTRUNCATE, OP_RENAME, NUM_OPS
+};
+
+static const char *const op_names[NUM_OPS] = {
+    "getattr", "mknod", "mkdir", "unlink", "rmdir", "read", "write", "readdir",
+    "open", "create", "release", "fallocate", "fsync", "flush", "fsyncdir",
+    "truncate", "ftruncate", "rename",
+};
+
+static struct stat_hist op_stats[NUM_OPS];        // Latency in ns
+static struct stat_hist inode_scan_stats;         // Words scanned per allocation
+static struct stat_hist data_scan_stats;
+static uint64_t disk_reads[MAX_DISKS];
+static uint64_t disk_read_bytes[MAX_DISKS];
+static uint64_t disk_writes[MAX_DISKS];
+static uint64_t disk_write_bytes[MAX_DISKS];
+
+static void stat_hist_add(struct stat_hist *h, uint64_t value) {
+    int bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= STAT_BUCKETS) bucket = STAT_BUCKETS - 1;
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, value, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t stat_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Records an operation that started at start (from stat_clock)
+static void stat_op_done(int op, uint64_t start) {
+    stat_hist_add(&op_stats[op], stat_clock() - start);
+}
+
+// Counts len bytes read from or written to a disk's data region
+static void stat_disk_io(int disk_idx, int write, size_t len) {
+    if (write) {
+        __atomic_add_fetch(&disk_writes[disk_idx], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&disk_write_bytes[disk_idx], len, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&disk_reads[disk_idx], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&disk_read_bytes[disk_idx], len, __ATOMIC_RELAXED);
+    }
+}
+
+static void stat_hist_write(FILE *out, const char *name, const char *unit, const struct stat_hist *h) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        return;
+    }
+    fprintf(out, "%s: count=%" PRIu64 " avg_%s=%" PRIu64 " max_%s=%" PRIu64 "\n", name, count,
+            unit, __atomic_load_n(&h->total, __ATOMIC_RELAXED) / count, unit, __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        uint64_t n = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if (n > 0) {
+            fprintf(out, "  < %" PRIu64 " %s: %" PRIu64 "\n", (uint64_t) 1 << b, unit, n);
+        }
+    }
+}
+
+// Write-back
+//
+// The disks are shared mappings, so the kernel writes changed pages back
+// whenever it likes. Every write to a mapping also sets its pages in a
+// per-disk dirty page bitmap, and wb_sync msyncs (MS_SYNC) only the runs of
+// dirty pages rather than the whole image. A flusher thread syncs every
+// WB_INTERVAL_MS, or as soon as more than dirty_bytes (mount option,
+// default 8 MiB) are dirty, so an fsync rarely has much left to write.
+//
+// On journaled images the metadata region is mapped privately; checkpoints
+// write it through meta_maps, a shared view of the same bytes, which is
+// also what gets synced.
+#define WB_INTERVAL_MS 1000
+
+static uint64_t *wb_pages[MAX_DISKS];    // One bit per page, set while dirty
+static size_t wb_nwords = 0;
+static long wb_page_size = 4096;
+static size_t wb_meta_pages = 0;         // Pages synced through meta_maps
+static char *meta_maps[MAX_DISKS];
+static size_t wb_dirty_bytes = 0;        // Bytes in dirty pages, all disks
+static unsigned long wb_dirty_limit = 8UL << 20;
+static pthread_mutex_t wb_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_wake = PTHREAD_COND_INITIALIZER;
+static int wb_wanted = 0;
+static int wb_stopping = 0;
+static pthread_t wb_thread;
+static int wb_thread_running = 0;
+static uint64_t wb_syncs = 0;
+static uint64_t wb_ranges = 0;
+static uint64_t wb_bytes = 0;
+
+// Wakes the flusher without waiting for it
+static void wb_kick(void) {
+    pthread_mutex_lock(&wb_lock);
+    wb_wanted = 1;
+    pthread_cond_signal(&wb_wake);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+// Marks len bytes at addr, inside disk disk_idx's mapping, for write-back.
+// Call after the bytes have been changed.
+static void wb_mark(int disk_idx, const char *addr, size_t len) {
+    uint64_t *pages = wb_pages[disk_idx];
+    if (pages == NULL || len == 0) {
+        return;
+    }
+    size_t offset = addr - disk_maps[disk_idx];
+    size_t newly = 0;
+    for (size_t p = offset / wb_page_size; p <= (offset + len - 1) / wb_page_size; p++) {
+        uint64_t bit = 1ULL << (p % 64);
+        if (!(__atomic_fetch_or(&pages[p / 64], bit, __ATOMIC_ACQ_REL) & bit)) {
+            newly++;
+        }
+    }
+    if (newly > 0) {
+        size_t added = newly * wb_page_size;
+        size_t dirty = __atomic_add_fetch(&wb_dirty_bytes, added, __ATOMIC_RELAXED);
+        if (dirty > wb_dirty_limit && dirty - added <= wb_dirty_limit) {
+            wb_kick();
+        }
+    }
+}
+
+// msyncs pages [first, first + count) of a disk
+static int wb_sync_run(int disk_idx, size_t first, size_t count) {
+    char *base = first < wb_meta_pages ? meta_maps[disk_idx] : disk_maps[disk_idx];
+    if (msync(base + first * wb_page_size, count * wb_page_size, MS_SYNC) != 0) {
+        TRACE(TRACE_ERROR, "wb_sync_run: msync of %zu pages at page %zu failed on disk %d: %s",
+                count, first, disk_idx, strerror(errno));
+        return -EIO;
+    }
+    wb_ranges++;
+    wb_bytes += count * wb_page_size;
+    return 0;
+}
+
+// Writes back every page marked so far and waits for it to reach the disks.
+// Returns 0 or -EIO.
+int wb_sync(void) {
+    int res = 0;
+    size_t cleared = 0;
+    pthread_mutex_lock(&wb_sync_lock);
+    for (int i = 0; i < num_disks; i++) {
+        uint64_t *pages = wb_pages[i];
+        if (pages == NULL) continue;
+        size_t run_first = 0, run_count = 0;
+        for (size_t w = 0; w < wb_nwords; w++) {
+            if (__atomic_load_n(&pages[w], __ATOMIC_RELAXED) == 0) continue;
+            uint64_t bits = __atomic_exchange_n(&pages[w], 0, __ATOMIC_ACQ_REL);
+            while (bits != 0) {
+                size_t p = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                cleared++;
+                // Runs break where the shared view changes
+                if (run_count > 0 && p == run_first + run_count && p != wb_meta_pages) {
+                    run_count++;
+                    continue;
+                }
+                if (run_count > 0 && wb_sync_run(i, run_first, run_count) != 0) {
+                    res = -EIO;
+                }
+                run_first = p;
+                run_count = 1;
+            }
+        }
+        if (run_count > 0 && wb_sync_run(i, run_first, run_count) != 0) {
+            res = -EIO;
+        }
+    }
+    __atomic_sub_fetch(&wb_dirty_bytes, cleared * wb_page_size, __ATOMIC_RELAXED);
+    wb_syncs++;
+    pthread_mutex_unlock(&wb_sync_lock);
+    return res;
+}
+
+static void *wb_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&wb_lock);
+    while (!wb_stopping) {
+        struct timespec deadline;
+        deadline_after_ms(&deadline, WB_INTERVAL_MS);
+        while (!wb_wanted && !wb_stopping) {
+            if (pthread_cond_timedwait(&wb_wake, &wb_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        wb_wanted = 0;
+        pthread_mutex_unlock(&wb_lock);
+        if (__atomic_load_n(&wb_dirty_bytes, __ATOMIC_RELAXED) > 0) {
+            wb_sync();
+        }
+        pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+// Allocates the dirty page bitmaps of the disks that are present. Called
+// once the disks are in order; returns -1 if out of memory.
+int wb_setup(void) {
+    wb_page_size = sysconf(_SC_PAGESIZE);
+    size_t npages = (fs_size + wb_page_size - 1) / wb_page_size;
+    wb_nwords = (npages + 63) / 64;
+    for (int i = 0; i < num_disks; i++) {
+        if (fd_disks[i] < 0) continue;
+        wb_pages[i] = calloc(wb_nwords, sizeof(uint64_t));
+        if (wb_pages[i] == NULL) {
+            TRACE(TRACE_ERROR, "wb_setup: Memory allocation failed.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Called from wfs_init, after FUSE has daemonized
+void wb_start(void) {
+    if (pthread_create(&wb_thread, NULL, wb_main, NULL) != 0) {
+        TRACE(TRACE_ERROR, "wb_start: Failed to start the flusher, writing back on fsync and unmount only");
+        return;
+    }
+    wb_thread_running = 1;
+}
+
+// Stops the flusher and writes back whatever is still dirty
+void wb_stop(void) {
+    if (wb_thread_running) {
+        pthread_mutex_lock(&wb_lock);
+        wb_stopping = 1;
+        pthread_cond_signal(&wb_wake);
+        pthread_mutex_unlock(&wb_lock);
+        pthread_join(wb_thread, NULL);
+        wb_thread_running = 0;
+    }
+    wb_sync();
+}
+
+// RAID functions
+//
+// The extent functions move size bytes starting at byte offset inside data
+// block block_number; the range may run on into the following blocks. They
+// copy straight from/to the disk mappings, so callers need no bounce buffer.
+
+// RAID 0 striping
+//
+// Stripe units of stripe_blocks data blocks rotate across the disks; unit u
+// lives on disk u % num_disks at unit slot u / num_disks. With the default
+// unit of one block this is plain block interleaving.
+static int stripe_blocks = 1;
+
+// Copies the part of the range that lives on disk only_disk (-1 for all
+// disks), one contiguous piece per stripe unit
+static void raid0_copy(char *buf, off_t block_number, size_t offset, size_t size, int write, int only_disk) {
+    size_t done = 0;
+    while (done < size) {
+        off_t block = block_number + (offset + done) / block_size;
+        size_t block_offset = (offset + done) % block_size;
+        off_t unit = block / stripe_blocks;
+        int unit_block = block % stripe_blocks;
+        int disk_idx = unit % num_disks;
+        size_t chunk = (size_t)(stripe_blocks - unit_block) * block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        if (only_disk < 0 || disk_idx == only_disk) {
+            off_t disk_block = (unit / num_disks) * stripe_blocks + unit_block;
+            char *disk_addr = disk_maps[disk_idx] + superblock.d_blocks_ptr + disk_block * block_size + block_offset;
+            if (write) {
+                memcpy(disk_addr, buf + done, chunk);
+                wb_mark(disk_idx, disk_addr, chunk);
+            } else {
+                memcpy(buf + done, disk_addr, chunk);
+            }
+            stat_disk_io(disk_idx, write, chunk);
+        }
+        done += chunk;
+    }
+}
+
+// Parallel I/O
+//
+// A large transfer is split into one task per disk: for RAID 0 each task
+// copies the stripe units on its disk, for RAID 1 reads each task copies a
+// slice of the range from a different mirror. The calling thread runs the
+// first task itself while a small pool of workers (stripe_threads=N, default
+// one per extra disk) runs the others. Transfers under STRIPE_PARALLEL_MIN
+// are copied inline since the handoff would cost more than it saves.
+#define STRIPE_PARALLEL_MIN (16 * 1024)
+
+struct stripe_batch {
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+struct stripe_task {
+    void (*copy)(struct stripe_task *task);
+    char *buf;
+    off_t block_number;
+    size_t offset;
+    size_t size;
+    int write;
+    int disk;
+    struct stripe_batch *batch;
+    struct stripe_task *next;
+};
+
+static int stripe_threads = -1;
+static int stripe_nworkers = 0;
+static pthread_t stripe_workers[MAX_DISKS];
+static struct stripe_task *stripe_queue = NULL;
+static int stripe_stopping = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_cond = PTHREAD_COND_INITIALIZER;
+
+static void *stripe_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&stripe_lock);
+    for (;;) {
+        while (stripe_queue == NULL && !stripe_stopping) {
+            pthread_cond_wait(&stripe_cond, &stripe_lock);
+        }
+        if (stripe_queue == NULL) {
+            break;
+        }
+        struct stripe_task *task = stripe_queue;
+        stripe_queue = task->next;
+        pthread_mutex_unlock(&stripe_lock);
+
+        task->copy(task);
+
+        struct stripe_batch *batch = task->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0) {
+            pthread_cond_signal(&batch->done);
+        }
+        pthread_mutex_unlock(&batch->lock);
+        pthread_mutex_lock(&stripe_lock);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    return NULL;
+}
+
+// Called from wfs_init, after FUSE has daemonized
+void stripe_start(void) {
+    if (raid_mode != 0 && raid_mode != 1) {
+        return;
+    }
+    int wanted = stripe_threads < 0 ? num_disks - 1 : stripe_threads;
+    if (wanted > MAX_DISKS) {
+        wanted = MAX_DISKS;
+    }
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&stripe_workers[i], NULL, stripe_worker, NULL) != 0) {
+            TRACE(TRACE_ERROR, "stripe_start: Failed to start worker %d", i);
+            break;
+        }
+        stripe_nworkers++;
+    }
+    TRACE(TRACE_INFO, "stripe_start: %d workers, stripe unit %d blocks", stripe_nworkers, stripe_blocks);
+}
+
+void stripe_stop(void) {
+    pthread_mutex_lock(&stripe_lock);
+    stripe_stopping = 1;
+    pthread_cond_broadcast(&stripe_cond);
+    pthread_mutex_unlock(&stripe_lock);
+    for (int i = 0; i < stripe_nworkers; i++) {
+        pthread_join(stripe_workers[i], NULL);
+    }
+    stripe_nworkers = 0;
+}
+
+// Runs tasks[1..ntasks) on the pool and tasks[0] on the calling thread, and
+// returns once all of them are done
+static void stripe_run(struct stripe_task *tasks, int ntasks) {
+    struct stripe_batch batch;
+    batch.pending = ntasks - 1;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+
+    pthread_mutex_lock(&stripe_lock);
+    for (int i = 1; i < ntasks; i++) {
+        tasks[i].batch = &batch;
+        tasks[i].next = stripe_queue;
+        stripe_queue = &tasks[i];
+    }
+    pthread_cond_broadcast(&stripe_cond);
+    pthread_mutex_unlock(&stripe_lock);
+
+    tasks[0].copy(&tasks[0]);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+}
+
+static void raid0_task(struct stripe_task *task) {
+    raid0_copy(task->buf, task->block_number, task->offset, task->size, task->write, task->disk);
+}
+
+static void raid0_io(char *buf, off_t block_number, size_t offset, size_t size, int write) {
+    if (stripe_nworkers == 0 || size < STRIPE_PARALLEL_MIN) {
+        raid0_copy(buf, block_number, offset, size, write, -1);
+        return;
+    }
+
+    struct stripe_task tasks[MAX_DISKS];
+    for (int d = 0; d < num_disks; d++) {
+        tasks[d] = (struct stripe_task) { raid0_task, buf, block_number, offset, size, write, d, NULL, NULL };
+    }
+    stripe_run(tasks, num_disks);
+}
+
+// Mirror read balancing
+//
+// RAID 1 reads can be served by any mirror. read_policy picks one per read:
+//   rr        round-robin across the mirrors (default)
+//   lod       the mirror with the fewest reads in flight
+//   locality  by block range, so neighbouring blocks come from one mirror
+// Reads large enough for the pool are instead sliced across all mirrors.
+// Per-disk read counts and bytes are part of the statistics report.
+#define READ_ROUND_ROBIN       0
+#define READ_LEAST_OUTSTANDING 1
+#define READ_LOCALITY          2
+#define LOCALITY_REGION_BLOCKS 64
+
+static int read_policy = READ_ROUND_ROBIN;
+static unsigned int read_next = 0;
+static int disk_outstanding[MAX_DISKS];
+
+static int mirror_pick(off_t block_number) {
+    if (read_policy == READ_LOCALITY) {
+        return (block_number / LOCALITY_REGION_BLOCKS) % num_disks;
+    }
+    int start = __atomic_fetch_add(&read_next, 1, __ATOMIC_RELAXED) % num_disks;
+    if (read_policy == READ_LEAST_OUTSTANDING) {
+        // Scan from the round-robin position so ties rotate too
+        int best = start;
+        int best_load = __atomic_load_n(&disk_outstanding[start], __ATOMIC_RELAXED);
+        for (int i = 1; i < num_disks; i++) {
+            int disk_idx = (start + i) % num_disks;
+            int load = __atomic_load_n(&disk_outstanding[disk_idx], __ATOMIC_RELAXED);
+            if (load < best_load) {
+                best = disk_idx;
+                best_load = load;
+            }
+        }
+        return best;
+    }
+    return start;
+}
+
+static void mirror_read(char *dst, int disk_idx, off_t block_number, size_t offset, size_t size) {
+    __atomic_add_fetch(&disk_outstanding[disk_idx], 1, __ATOMIC_RELAXED);
+    memcpy(dst, disk_maps[disk_idx] + superblock.d_blocks_ptr + block_number * block_size + offset, size);
+    __atomic_sub_fetch(&disk_outstanding[disk_idx], 1, __ATOMIC_RELAXED);
+    stat_disk_io(disk_idx, 0, size);
+}
+
+static void mirror_task(struct stripe_task *task) {
+    mirror_read(task->buf, task->disk, task->block_number, task->offset, task->size);
+}
+
+static void raid1_read(char *dst, off_t block_number, size_t offset, size_t size) {
+    int first = mirror_pick(block_number);
+    if (stripe_nworkers == 0 || size < STRIPE_PARALLEL_MIN) {
+        mirror_read(dst, first, block_number, offset, size);
+        return;
+    }
+
+    // One slice per mirror, starting from the picked one
+    struct stripe_task tasks[MAX_DISKS];
+    size_t slice = (size + num_disks - 1) / num_disks;
+    int ntasks = 0;
+    for (size_t done = 0; done < size; done += slice) {
+        size_t len = size - done < slice ? size - done : slice;
+        tasks[ntasks] = (struct stripe_task) { mirror_task, dst + done, block_number, offset + done, len, 0,
+                                               (first + ntasks) % num_disks, NULL, NULL };
+        ntasks++;
+    }
+    stripe_run(tasks, ntasks);
+}
+
+// RAID 1v majority vote for one block, compared in place on the mappings.
+// Returns the index of the disk whose copy is held by the most disks (ties
+// go to the lower index).
+static int raid1v_vote(off_t block_number) {
+    off_t disk_offset = superblock.d_blocks_ptr + block_number * block_size;
+    int counts[MAX_DISKS] = {0};
+    for (int i = 0; i < num_disks; i++) {
+        for (int j = i + 1; j < num_disks; j++) {
+            if (memcmp(disk_maps[i] + disk_offset, disk_maps[j] + disk_offset, block_size) == 0) {
+                counts[i]++;
+                counts[j]++;
+            }
+        }
+    }
+    int max_idx = 0;
+    for (int i = 1; i < num_disks; i++) {
+        if (counts[i] > counts[max_idx]) {
+            max_idx = i;
+        }
+    }
+    return max_idx;
+}
+
+// RAID 5
+//
+// Each stripe holds num_disks - 1 data units (stripe_blocks blocks each) and
+// one parity unit, all at the same unit slot on their disks. Parity rotates
+// backwards across the disks from stripe to stripe. A write that covers a
+// whole stripe computes parity from the new data alone; smaller writes fold
+// the old and new data into the existing parity (read-modify-write). One
+// disk may be missing: its units are rebuilt from the others on read and
+// writes keep the parity consistent without it. Writes and rebuilds of a
+// stripe are serialised by one of RAID5_STRIPE_LOCKS mutexes.
+#define RAID5_STRIPE_LOCKS 64
+
+static int missing_disk = -1;
+static pthread_mutex_t raid5_locks[RAID5_STRIPE_LOCKS];
+
+struct raid5_loc {
+    off_t stripe;
+    int disk;            // Disk holding the data unit
+    int parity_disk;     // Disk holding the stripe's parity unit
+    off_t disk_block;    // Block slot on both of them
+};
+
+static void raid5_locate(off_t block_number, struct raid5_loc *loc) {
+    off_t unit = block_number / stripe_blocks;
+    int data_disks = num_disks - 1;
+    int k = unit % data_disks;
+    loc->stripe = unit / data_disks;
+    loc->parity_disk = num_disks - 1 - loc->stripe % num_disks;
+    loc->disk = k < loc->parity_disk ? k : k + 1;
+    loc->disk_block = loc->stripe * stripe_blocks + block_number % stripe_blocks;
+}
+
+static char *raid5_addr(int disk_idx, off_t disk_block, size_t block_offset) {
+    return disk_maps[disk_idx] + superblock.d_blocks_ptr + disk_block * block_size + block_offset;
+}
+
+// dst ^= src, 32 bytes at a time with GCC vector extensions so the compiler
+// can use the widest XOR the target has
+typedef uint64_t xor_vec __attribute__((vector_size(32)));
+
+static void xor_into(char *dst, const char *src, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(xor_vec) <= len; i += sizeof(xor_vec)) {
+        xor_vec a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+// Rebuilds len bytes of the missing disk at disk_block/block_offset from
+// every other disk of the stripe. Caller holds the stripe lock.
+static void raid5_rebuild(char *dst, off_t disk_block, size_t block_offset, size_t len) {
+    memset(dst, 0, len);
+    for (int i = 0; i < num_disks; i++) {
+        if (i != missing_disk) {
+            xor_into(dst, raid5_addr(i, disk_block, block_offset), len);
+            stat_disk_io(i, 0, len);
+        }
+    }
+}
+
+static void raid5_read(char *buf, off_t block_number, size_t offset, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        off_t block = block_number + (offset + done) / block_size;
+        size_t block_offset = (offset + done) % block_size;
+        size_t chunk = (size_t)(stripe_blocks - block % stripe_blocks) * block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        struct raid5_loc loc;
+        raid5_locate(block, &loc);
+        if (loc.disk != missing_disk) {
+            memcpy(buf + done, raid5_addr(loc.disk, loc.disk_block, block_offset), chunk);
+            stat_disk_io(loc.disk, 0, chunk);
+        } else {
+            pthread_mutex_t *lock = &raid5_locks[loc.stripe % RAID5_STRIPE_LOCKS];
+            pthread_mutex_lock(lock);
+            raid5_rebuild(buf + done, loc.disk_block, block_offset, chunk);
+            pthread_mutex_unlock(lock);
+        }
+        done += chunk;
+    }
+}
+
+// Writes a whole stripe; parity comes from the new data without any reads
+static void raid5_write_stripe(const char *src, off_t first_block) {
+    size_t unit_bytes = (size_t) stripe_blocks * block_size;
+    struct raid5_loc loc;
+    raid5_locate(first_block, &loc);
+    char *parity = loc.parity_disk != missing_disk ? raid5_addr(loc.parity_disk, loc.disk_block, 0) : NULL;
+
+    for (int k = 0; k < num_disks - 1; k++) {
+        const char *unit = src + k * unit_bytes;
+        int disk_idx = k < loc.parity_disk ? k : k + 1;
+        if (disk_idx != missing_disk) {
+            memcpy(raid5_addr(disk_idx, loc.disk_block, 0), unit, unit_bytes);
+            wb_mark(disk_idx, raid5_addr(disk_idx, loc.disk_block, 0), unit_bytes);
+            stat_disk_io(disk_idx, 1, unit_bytes);
+        }
+        if (parity != NULL) {
+            if (k == 0) {
+                memcpy(parity, unit, unit_bytes);
+            } else {
+                xor_into(parity, unit, unit_bytes);
+            }
+        }
+    }
+    if (parity != NULL) {
+        wb_mark(loc.parity_disk, parity, unit_bytes);
+        stat_disk_io(loc.parity_disk, 1, unit_bytes);
+    }
+}
+
+// Writes part of one data unit, folding old and new data into the parity
+static void raid5_write_unit(const char *src, off_t block, size_t block_offset, size_t len) {
+    struct raid5_loc loc;
+    raid5_locate(block, &loc);
+    char *data = raid5_addr(loc.disk, loc.disk_block, block_offset);
+    char *parity = raid5_addr(loc.parity_disk, loc.disk_block, block_offset);
+
+    // Read-modify-write reads the old data and parity
+    if (loc.parity_disk == missing_disk) {
+        memcpy(data, src, len);
+    } else if (loc.disk == missing_disk) {
+        // The old data only exists as parity ^ the rest of the stripe
+        char old[block_size];
+        for (size_t done = 0; done < len; done += block_size) {
+            size_t piece = len - done < block_size ? len - done : block_size;
+            raid5_rebuild(old, loc.disk_block, block_offset + done, piece);
+            xor_into(parity + done, old, piece);
+            xor_into(parity + done, src + done, piece);
+        }
+    } else {
+        xor_into(parity, data, len);
+        xor_into(parity, src, len);
+        memcpy(data, src, len);
+        stat_disk_io(loc.disk, 0, len);
+    }
+    if (loc.parity_disk != missing_disk) {
+        stat_disk_io(loc.parity_disk, 0, len);
+        stat_disk_io(loc.parity_disk, 1, len);
+    }
+    if (loc.disk != missing_disk) {
+        stat_disk_io(loc.disk, 1, len);
+    }
+    wb_mark(loc.disk, data, len);
+    wb_mark(loc.parity_disk, parity, len);
+}
+
+static void raid5_write(const char *buf, off_t block_number, size_t offset, size_t size) {
+    size_t unit_bytes = (size_t) stripe_blocks * block_size;
+    size_t stripe_bytes = unit_bytes * (num_disks - 1);
+    off_t pos = block_number * block_size + offset;
+    off_t end = pos + size;
+
+    while (pos < end) {
+        off_t stripe = pos / stripe_bytes;
+        off_t stripe_end = (stripe + 1) * stripe_bytes;
+        size_t len = (end < stripe_end ? end : stripe_end) - pos;
+        pthread_mutex_t *lock = &raid5_locks[stripe % RAID5_STRIPE_LOCKS];
+
+        pthread_mutex_lock(lock);
+        if (len == stripe_bytes) {
+            raid5_write_stripe(buf, pos / block_size);
+        } else {
+            // One piece per data unit touched
+            size_t done = 0;
+            while (done < len) {
+                off_t at = pos + done;
+                size_t piece = unit_bytes - at % unit_bytes;
+                if (piece > len - done) {
+                    piece = len - done;
+                }
+                raid5_write_unit(buf + done, at / block_size, at % block_size, piece);
+                done += piece;
+            }
+        }
+        pthread_mutex_unlock(lock);
+
+        buf += len;
+        pos += len;
+    }
+}
+
+// RAID 1v checksums
+//
+// Images made with WFS_FEATURE_CSUM keep a CRC32C for every data block after
+// the data region of each disk. A read checks one copy (rotating between the
+// disks) against its checksum; only on a mismatch are the copies compared,
+// and the bad ones are rewritten from the good one. Older images fall back to
+// voting on every read.
+static int csum_enabled = 0;
+static pthread_mutex_t csum_repair_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t csum_repairs = 0;
+
+static uint32_t *block_csums(int disk_idx) {
+    return (uint32_t *)(disk_maps[disk_idx] + superblock.d_blocks_ptr + num_data_blocks * block_size);
+}
+
+static char *raid1v_block(int disk_idx, off_t block_number) {
+    return disk_maps[disk_idx] + superblock.d_blocks_ptr + block_number * block_size;
+}
+
+// Recomputes the checksums of data blocks first..last after a write. The
+// copies are identical at this point, so disk 0's is checksummed.
+static void csum_update(off_t first, off_t last) {
+    if (!csum_enabled) {
+        return;
+    }
+    for (off_t block = first; block <= last; block++) {
+        uint32_t crc = crc32c(raid1v_block(0, block), block_size);
+        for (int i = 0; i < num_disks; i++) {
+            block_csums(i)[block] = crc;
+        }
+    }
+    for (int i = 0; i < num_disks; i++) {
+        wb_mark(i, (char *) &block_csums(i)[first], (last - first + 1) * sizeof(uint32_t));
+    }
+}
+
+// Picks the good copy of a block whose checked copy failed and rewrites every
+// copy (and checksum) that differs from it. Prefers a copy that matches its
+// own checksum; if none does, the majority vote decides.
+static int raid1v_repair(off_t block_number) {
+    pthread_mutex_lock(&csum_repair_lock);
+    int good = -1;
+    for (int i = 0; i < num_disks && good < 0; i++) {
+        if (crc32c(raid1v_block(i, block_number), block_size) == block_csums(i)[block_number]) {
+            good = i;
+        }
+    }
+    if (good < 0) {
+        good = raid1v_vote(block_number);
+    }
+
+    uint32_t crc = crc32c(raid1v_block(good, block_number), block_size);
+    for (int i = 0; i < num_disks; i++) {
+        if (i != good && memcmp(raid1v_block(i, block_number), raid1v_block(good, block_number), block_size) != 0) {
+            memcpy(raid1v_block(i, block_number), raid1v_block(good, block_number), block_size);
+            wb_mark(i, raid1v_block(i, block_number), block_size);
+            TRACE(TRACE_ERROR, "raid1v_repair: Repaired block %ld on disk %d from disk %d", block_number, i, good);
+            csum_repairs++;
+        }
+        block_csums(i)[block_number] = crc;
+        wb_mark(i, (char *) &block_csums(i)[block_number], sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&csum_repair_lock);
+    return good;
+}
+
+// Returns the disk to read a RAID 1v block from
+static int raid1v_pick(off_t block_number) {
+    if (!csum_enabled) {
+        return raid1v_vote(block_number);
+    }
+    int disk_idx = __atomic_fetch_add(&read_next, 1, __ATOMIC_RELAXED) % num_disks;
+    if (crc32c(raid1v_block(disk_idx, block_number), block_size) == block_csums(disk_idx)[block_number]) {
+        return disk_idx;
+    }
+    return raid1v_repair(block_number);
+}
+
+ssize_t raid_read_extent(void *buf, off_t block_number, size_t offset, size_t size) {
+    char *dst = buf;
+    if (raid_mode == 1) {
+        // RAID 1: the run is contiguous on every mirror
+        raid1_read(dst, block_number, offset, size);
+        return size;
+    }
+    if (raid_mode == 0) {
+        raid0_io(dst, block_number, offset, size, 0);
+        return size;
+    }
+    if (raid_mode == 3) {
+        raid5_read(dst, block_number, offset, size);
+        return size;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        off_t block = block_number + (offset + done) / block_size;
+        size_t block_offset = (offset + done) % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        // RAID 1v: one checksummed copy, voting only when it is bad
+        int disk_idx = raid1v_pick(block);
+        memcpy(dst + done, disk_maps[disk_idx] + superblock.d_blocks_ptr + block * block_size + block_offset, chunk);
+        stat_disk_io(disk_idx, 0, chunk);
+        done += chunk;
+    }
+    return size;
+}
+
+ssize_t raid_write_extent(const void *buf, off_t block_number, size_t offset, size_t size) {
+    const char *src = buf;
+    if (raid_mode == 1 || raid_mode == 2) {
+        // RAID 1 and RAID 1v
+        for (int i = 0; i < num_disks; i++) {
+            char *dst = disk_maps[i] + superblock.d_blocks_ptr + block_number * block_size + offset;
+            memcpy(dst, src, size);
+            wb_mark(i, dst, size);
+            stat_disk_io(i, 1, size);
+        }
+        if (raid_mode == 2) {
+            csum_update(block_number + offset / block_size, block_number + (offset + size - 1) / block_size);
+        }
+        return size;
+    }
+
+    if (raid_mode == 3) {
+        raid5_write(src, block_number, offset, size);
+        return size;
+    }
+
+    // RAID 0
+    raid0_io((char *) src, block_number, offset, size, 1);
+    return size;
+}
+
+ssize_t raid_read(void *buf, off_t block_number, size_t size) {
+    return raid_read_extent(buf, block_number, 0, size);
+}
+
+ssize_t raid_write(void *buf, off_t block_number, size_t size) {
+    return raid_write_extent(buf, block_number, 0, size);
+}
+
+// Metadata journal
+//
+// On images with WFS_FEATURE_JOURNAL the superblock, bitmaps and inode table
+// are mapped MAP_PRIVATE, so changing them only changes memory, and changes
+// to directory and indirect blocks go to an in-memory copy of the block
+// (meta_read_block/meta_write_block) rather than to the disks. Each change
+// marks its block dirty in the running transaction.
+//
+// A committer thread closes the running transaction every commit_ms
+// milliseconds (default 100), or sooner once the journal is filling up, and
+//   1. syncs the disks, so file data and the previous checkpoint are durable
+//   2. writes the dirty blocks and a checksummed commit block to the journal
+//      and syncs again
+//   3. copies the blocks to their home locations (the checkpoint)
+// The journal only ever holds the latest transaction; a complete one found
+// at mount is copied home again, which is harmless if it already was.
+//
+// Operations that change metadata run between journal_begin and journal_end,
+// holding journal_txn_lock shared; the committer takes it exclusively to
+// close a transaction, so a transaction never holds half an operation. File
+// data is written in place and not journaled. Freed directory and indirect
+// blocks are not reused until the transaction freeing them has committed, so
+// replay can never write a stale directory block over file data; an
+// operation that runs out of space while such blocks are pending forces a
+// commit and retries once.
+#define JOURNAL_MAGIC          0x4a534657u   // "WFSJ"
+#define JOURNAL_COMMIT_MAGIC   0x43534657u   // "WFSC"
+#define JOURNAL_META           (1ULL << 63)  // Location is a metadata byte offset
+#define JOURNAL_LOCS_PER_BLOCK (block_size / sizeof(uint64_t))
+#define JOURNAL_OP_BLOCKS      12            // Room reserved per operation in flight
+#define META_CACHE_BUCKETS     256
+#define META_CACHE_MAX         1024          // Clean cached blocks kept after a commit
+
+// A transaction on disk: this header, the locations of its blocks
+// (JOURNAL_LOCS_PER_BLOCK per block), the block images and a commit block
+struct journal_header {
+    uint32_t magic;
+    uint32_t count;      // Block images in the transaction
+    uint64_t seq;
+};
+
+struct journal_commit_block {
+    uint32_t magic;
+    uint32_t crc;        // CRC32C of every block of the transaction before this one
+    uint64_t seq;
+};
+
+// Directory or indirect block whose latest contents may not be on disk yet
+struct meta_block {
+    off_t block;
+    int dirty;           // Changed in the running transaction
+    struct meta_block *next;
+    char data[];         // block_size bytes
+};
+
+static int journal_enabled = 0;
+static int commit_interval_ms = 100;
+static int journal_max_blocks = 0;       // Most blocks one transaction can carry
+static uint64_t journal_seq = 0;
+static pthread_rwlock_t journal_txn_lock;
+static __thread int journal_depth = 0;   // journal_begin nesting in this thread
+
+// The running transaction, guarded by journal_lock
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_space = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;
+static char *meta_dirty;                 // One flag per metadata block
+static int meta_nblocks = 0;
+static struct meta_block *meta_cache[META_CACHE_BUCKETS];
+static int meta_cache_count = 0;
+static int journal_dirty = 0;            // Dirty metadata and cached blocks
+static int journal_active = 0;           // Operations between begin and end
+static int journal_wanted = 0;           // Commit requested before the interval
+static int journal_stopping = 0;
+static off_t *journal_frees = NULL;      // Freed blocks waiting for the commit
+static int journal_nfrees = 0;
+static int journal_frees_cap = 0;
+static int journal_unreleased = 0;       // Freed blocks not yet back in the bitmap
+
+static pthread_mutex_t journal_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t journal_thread;
+static int journal_thread_running = 0;
+static uint64_t journal_commits = 0;
+static uint64_t journal_blocks_logged = 0;
+static uint64_t journal_overflows = 0;
+
+void free_data_block(int block_num);
+void free_data_blocks(const off_t *blocks, int n);
+static void icache_flush(int lock_inodes);
+
+// Starts an operation that changes metadata. Waits while the running
+// transaction is too full to take another operation.
+void journal_begin(void) {
+    if (!journal_enabled || journal_depth++ > 0) {
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    while (journal_dirty + (journal_active + 1) * JOURNAL_OP_BLOCKS > journal_max_blocks &&
+           (journal_dirty > 0 || journal_active > 0)) {
+        journal_wanted = 1;
+        pthread_cond_signal(&journal_wake);
+        pthread_cond_wait(&journal_space, &journal_lock);
+    }
+    journal_active++;
+    pthread_mutex_unlock(&journal_lock);
+    pthread_rwlock_rdlock(&journal_txn_lock);
+}
+
+void journal_end(void) {
+    if (!journal_enabled || --journal_depth > 0) {
+        return;
+    }
+    pthread_rwlock_unlock(&journal_txn_lock);
+    pthread_mutex_lock(&journal_lock);
+    journal_active--;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Marks the metadata bytes [offset, offset + len) as changed: dirty in the
+// running transaction, or without the journal, due for write-back
+static void journal_dirty_meta(off_t offset, size_t len) {
+    if (!journal_enabled) {
+        // The change is already in the shared mappings
+        for (int i = 0; i < num_disks; i++) {
+            wb_mark(i, disk_maps[i] + offset, len);
+        }
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    for (off_t b = offset / block_size; b <= (off_t)(offset + len - 1) / block_size; b++) {
+        if (!meta_dirty[b]) {
+            meta_dirty[b] = 1;
+            journal_dirty++;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Caller holds journal_lock
+static struct meta_block **meta_cache_slot(off_t block) {
+    struct meta_block **pp = &meta_cache[block % META_CACHE_BUCKETS];
+    while (*pp != NULL && (*pp)->block != block) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+// Reads a directory or indirect block
+ssize_t meta_read_block(void *buf, off_t block) {
+    if (journal_enabled) {
+        pthread_mutex_lock(&journal_lock);
+        struct meta_block *mb = *meta_cache_slot(block);
+        if (mb != NULL) {
+            memcpy(buf, mb->data, block_size);
+            pthread_mutex_unlock(&journal_lock);
+            return block_size;
+        }
+        pthread_mutex_unlock(&journal_lock);
+    }
+    return raid_read(buf, block, block_size);
+}
+
+// Writes a directory or indirect block. With the journal on it reaches the
+// disks at the next checkpoint.
+ssize_t meta_write_block(const void *buf, off_t block) {
+    if (!journal_enabled) {
+        return raid_write((void *) buf, block, block_size);
+    }
+    pthread_mutex_lock(&journal_lock);
+    struct meta_block **pp = meta_cache_slot(block);
+    if (*pp == NULL) {
+        *pp = calloc(1, sizeof(struct meta_block) + block_size);
+        if (*pp == NULL) {
+            pthread_mutex_unlock(&journal_lock);
+            TRACE(TRACE_ERROR, "meta_write_block: Out of memory for block %ld", block);
+            return -ENOMEM;
+        }
+        (*pp)->block = block;
+        meta_cache_count++;
+    }
+    memcpy((*pp)->data, buf, block_size);
+    if (!(*pp)->dirty) {
+        (*pp)->dirty = 1;
+        journal_dirty++;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return block_size;
+}
+
+// Queues freed blocks for journal_commit to hand back to the bitmap.
+// Caller holds journal_lock.
+static void journal_defer_frees_locked(const off_t *blocks, int n) {
+    if (journal_nfrees + n > journal_frees_cap) {
+        int cap = journal_frees_cap ? journal_frees_cap : 64;
+        while (cap < journal_nfrees + n) {
+            cap *= 2;
+        }
+        off_t *frees = realloc(journal_frees, cap * sizeof(off_t));
+        if (frees == NULL) {
+            // Leaking the blocks is safe, reusing them early is not
+            TRACE(TRACE_ERROR, "journal_defer_frees_locked: Out of memory, %d blocks stay allocated", n);
+            return;
+        }
+        journal_frees = frees;
+        journal_frees_cap = cap;
+    }
+    memcpy(journal_frees + journal_nfrees, blocks, n * sizeof(off_t));
+    journal_nfrees += n;
+    journal_unreleased += n;
+}
+
+// Frees a directory or indirect block. With the journal on the block only
+// goes back to the bitmap once the transaction freeing it has committed.
+void free_meta_block(int block_num) {
+    if (!journal_enabled) {
+        free_data_block(block_num);
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    struct meta_block **pp = meta_cache_slot(block_num);
+    if (*pp != NULL) {
+        struct meta_block *mb = *pp;
+        *pp = mb->next;
+        if (mb->dirty) {
+            journal_dirty--;
+        }
+        meta_cache_count--;
+        free(mb);
+    }
+    off_t block = block_num;
+    journal_defer_frees_locked(&block, 1);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Copies the same bytes to every disk at offset and marks them for
+// write-back. Metadata offsets go through the shared view, since the
+// mappings the rest of wfs uses are private there.
+static void journal_write_disks(const void *buf, size_t len, off_t offset) {
+    for (int i = 0; i < num_disks; i++) {
+        if (fd_disks[i] < 0) continue;
+        char *base = offset < (off_t) superblock.d_blocks_ptr ? meta_maps[i] : disk_maps[i];
+        memcpy(base + offset, buf, len);
+        wb_mark(i, disk_maps[i] + offset, len);
+    }
+}
+
+// Zeroes the first block of the journal, so it holds no transaction
+static void journal_clear(void) {
+    char empty[block_size];
+    memset(empty, 0, block_size);
+    journal_write_disks(empty, block_size, superblock.journal_ptr);
+}
+
+// Drops clean cached blocks once there are too many; their contents are on
+// disk. Called after a checkpoint, with journal_commit_lock held.
+static void meta_cache_trim(void) {
+    pthread_mutex_lock(&journal_lock);
+    if (meta_cache_count > META_CACHE_MAX) {
+        for (int i = 0; i < META_CACHE_BUCKETS; i++) {
+            struct meta_block **pp = &meta_cache[i];
+            while (*pp != NULL) {
+                struct meta_block *mb = *pp;
+                if (mb->dirty) {
+                    pp = &mb->next;
+                    continue;
+                }
+                *pp = mb->next;
+                free(mb);
+                meta_cache_count--;
+            }
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Closes the running transaction, commits it and checkpoints it
+void journal_commit(void) {
+    pthread_mutex_lock(&journal_commit_lock);
+    pthread_mutex_lock(&journal_lock);
+    int idle = journal_dirty == 0 && journal_nfrees == 0;
+    pthread_mutex_unlock(&journal_lock);
+    if (idle) {
+        pthread_mutex_unlock(&journal_commit_lock);
+        return;
+    }
+
+    // Copy out every dirty block while no operation is half done
+    pthread_rwlock_wrlock(&journal_txn_lock);
+    icache_flush(0);
+    pthread_mutex_lock(&journal_lock);
+    int count = journal_dirty;
+    int desc_blocks = (count + JOURNAL_LOCS_PER_BLOCK - 1) / JOURNAL_LOCS_PER_BLOCK;
+    size_t len = (size_t)(1 + desc_blocks + count + 1) * block_size;
+    char *txn = count > 0 ? calloc(1, len) : NULL;
+    if (count > 0 && txn == NULL) {
+        // Keep everything dirty and try again next time
+        pthread_mutex_unlock(&journal_lock);
+        pthread_rwlock_unlock(&journal_txn_lock);
+        pthread_mutex_unlock(&journal_commit_lock);
+        TRACE(TRACE_ERROR, "journal_commit: Out of memory for a %d block transaction", count);
+        return;
+    }
+    uint64_t *locs = (uint64_t *)(txn + block_size);
+    char *images = txn + (size_t)(1 + desc_blocks) * block_size;
+    int n = 0;
+    for (int b = 0; b < meta_nblocks && n < count; b++) {
+        if (meta_dirty[b]) {
+            meta_dirty[b] = 0;
+            locs[n] = JOURNAL_META | (uint64_t) b * block_size;
+            memcpy(images + (size_t) n * block_size, disk_maps[0] + (size_t) b * block_size, block_size);
+            n++;
+        }
+    }
+    for (int i = 0; i < META_CACHE_BUCKETS; i++) {
+        for (struct meta_block *mb = meta_cache[i]; mb != NULL; mb = mb->next) {
+            if (mb->dirty) {
+                mb->dirty = 0;
+                locs[n] = mb->block;
+                memcpy(images + (size_t) n * block_size, mb->data, block_size);
+                n++;
+            }
+        }
+    }
+    journal_dirty = 0;
+    off_t *frees = journal_frees;
+    int nfrees = journal_nfrees;
+    journal_frees = NULL;
+    journal_nfrees = journal_frees_cap = 0;
+    uint64_t seq = ++journal_seq;
+    pthread_cond_broadcast(&journal_space);
+    pthread_mutex_unlock(&journal_lock);
+    pthread_rwlock_unlock(&journal_txn_lock);
+
+    if (n > 0) {
+        struct journal_header *header = (struct journal_header *) txn;
+        header->magic = JOURNAL_MAGIC;
+        header->count = n;
+        header->seq = seq;
+        struct journal_commit_block *commit = (struct journal_commit_block *)(txn + len - block_size);
+        commit->magic = JOURNAL_COMMIT_MAGIC;
+        commit->seq = seq;
+        commit->crc = crc32c(txn, len - block_size);
+
+        wb_sync();
+        if (n <= journal_max_blocks) {
+            journal_write_disks(txn, len, superblock.journal_ptr);
+        } else {
+            // Retire the previous transaction so a replay cannot undo this one
+            journal_clear();
+            journal_overflows++;
+            TRACE(TRACE_ERROR, "journal_commit: %d blocks do not fit the journal (%d), writing them unjournaled",
+                    n, journal_max_blocks);
+        }
+        wb_sync();
+
+        // Checkpoint
+        for (int i = 0; i < n; i++) {
+            char *image = images + (size_t) i * block_size;
+            if (locs[i] & JOURNAL_META) {
+                journal_write_disks(image, block_size, locs[i] & ~JOURNAL_META);
+            } else {
+                raid_write(image, locs[i], block_size);
+            }
+        }
+        journal_commits++;
+        journal_blocks_logged += n;
+    }
+    free(txn);
+
+    // The freed blocks are safe to reuse now; clearing their bits goes into
+    // the next transaction
+    if (nfrees > 0) {
+        pthread_rwlock_rdlock(&journal_txn_lock);
+        free_data_blocks(frees, nfrees);
+        pthread_rwlock_unlock(&journal_txn_lock);
+        pthread_mutex_lock(&journal_lock);
+        journal_unreleased -= nfrees;
+        pthread_mutex_unlock(&journal_lock);
+    }
+    free(frees);
+    meta_cache_trim();
+    pthread_mutex_unlock(&journal_commit_lock);
+}
+
+// For an operation that failed with ENOSPC: if freed blocks are waiting for
+// a commit, commits and returns 1 so the operation is retried (once)
+int journal_should_retry(int res, int *retries) {
+    if (res != -ENOSPC || !journal_enabled || journal_depth > 0 || (*retries)++ > 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&journal_lock);
+    int pending = journal_unreleased > 0;
+    pthread_mutex_unlock(&journal_lock);
+    if (!pending) {
+        return 0;
+    }
+    journal_commit();
+    return 1;
+}
+
+static void *journal_main(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&journal_lock);
+    while (!journal_stopping) {
+        struct timespec deadline;
+        deadline_after_ms(&deadline, commit_interval_ms);
+        while (!journal_wanted && !journal_stopping) {
+            if (pthread_cond_timedwait(&journal_wake, &journal_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        journal_wanted = 0;
+        pthread_mutex_unlock(&journal_lock);
+        journal_commit();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+// Called from wfs_init, after FUSE has daemonized
+void journal_start(void) {
+    if (!journal_enabled) {
+        return;
+    }
+    if (pthread_create(&journal_thread, NULL, journal_main, NULL) != 0) {
+        TRACE(TRACE_ERROR, "journal_start: Failed to start the committer, committing on fsync and unmount only");
+        return;
+    }
+    journal_thread_running = 1;
+    TRACE(TRACE_INFO, "journal_start: %d block journal, commit every %d ms",
+            (int) superblock.journal_blocks, commit_interval_ms);
+}
+
+// Commits what is left and empties the journal, so the next mount has
+// nothing to replay
+void journal_stop(void) {
+    if (!journal_enabled) {
+        return;
+    }
+    if (journal_thread_running) {
+        pthread_mutex_lock(&journal_lock);
+        journal_stopping = 1;
+        pthread_cond_signal(&journal_wake);
+        pthread_mutex_unlock(&journal_lock);
+        pthread_join(journal_thread, NULL);
+        journal_thread_running = 0;
+    }
+    // The second commit carries the bitmap bits of blocks the first one
+    // released
+    journal_commit();
+    journal_commit();
+    wb_sync();
+    journal_clear();
+    wb_sync();
+}
+
+// Copies a complete transaction left in the journal to its home locations.
+// Runs at mount, while every disk is still mapped shared.
+static void journal_replay(void) {
+    char *journal = disk_maps[missing_disk == 0 ? 1 : 0] + superblock.journal_ptr;
+    struct journal_header header;
+    memcpy(&header, journal, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC) {
+        return;
+    }
+
+    int count = header.count;
+    int valid = count > 0 && count <= journal_max_blocks;
+    int desc_blocks = (count + JOURNAL_LOCS_PER_BLOCK - 1) / JOURNAL_LOCS_PER_BLOCK;
+    size_t len = (size_t)(1 + desc_blocks + count + 1) * block_size;
+    if (valid) {
+        struct journal_commit_block commit;
+        memcpy(&commit, journal + len - block_size, sizeof(commit));
+        valid = commit.magic == JOURNAL_COMMIT_MAGIC && commit.seq == header.seq &&
+                commit.crc == crc32c(journal, len - block_size);
+    }
+
+    if (valid) {
+        uint64_t *locs = (uint64_t *)(journal + block_size);
+        char *images = journal + (size_t)(1 + desc_blocks) * block_size;
+        for (int i = 0; i < count; i++) {
+            char *image = images + (size_t) i * block_size;
+            if (locs[i] & JOURNAL_META) {
+                uint64_t offset = locs[i] & ~JOURNAL_META;
+                if (offset + block_size > superblock.d_blocks_ptr) continue;
+                for (int d = 0; d < num_disks; d++) {
+                    memcpy(disk_maps[d] + offset, image, block_size);
+                    wb_mark(d, disk_maps[d] + offset, block_size);
+                }
+            } else if (locs[i] < num_data_blocks) {
+                raid_write(image, locs[i], block_size);
+            }
+        }
+        TRACE(TRACE_INFO, "journal_replay: Replayed transaction %" PRIu64 " (%d blocks)", header.seq, count);
+    } else {
+        TRACE(TRACE_INFO, "journal_replay: Discarded incomplete transaction %" PRIu64, header.seq);
+    }
+
+    // Make the replay durable before the transaction is forgotten
+    wb_sync();
+    journal_clear();
+    wb_sync();
+    journal_seq = header.seq;
+}
+
+// Checks the journal region, replays it and switches the metadata region of
+// every disk to a private mapping. Returns -1 if the image cannot be used.
+int journal_setup(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t data_end = superblock.d_blocks_ptr +
+                        wfs_disk_data_blocks(num_data_blocks, raid_mode, num_disks, stripe_blocks) * block_size;
+    if (superblock.journal_blocks < 16 || superblock.journal_ptr % block_size != 0 ||
+        superblock.journal_ptr < data_end ||
+        superblock.journal_ptr + superblock.journal_blocks * block_size > fs_size) {
+        TRACE(TRACE_ERROR, "journal_setup: Bad journal region.");
+        return -1;
+    }
+    if (superblock.d_blocks_ptr % page_size != 0 || superblock.d_blocks_ptr % block_size != 0) {
+        TRACE(TRACE_ERROR, "journal_setup: Metadata region is not a multiple of the %ld byte page size and the block size.",
+                page_size);
+        return -1;
+    }
+
+    // Header, location blocks, images and commit block must all fit
+    int total = superblock.journal_blocks;
+    journal_max_blocks = total - 2;
+    while (2 + (journal_max_blocks + (int) JOURNAL_LOCS_PER_BLOCK - 1) / (int) JOURNAL_LOCS_PER_BLOCK +
+           journal_max_blocks > total) {
+        journal_max_blocks--;
+    }
+    meta_nblocks = superblock.d_blocks_ptr / block_size;
+    meta_dirty = calloc(meta_nblocks, 1);
+    if (meta_dirty == NULL) {
+        TRACE(TRACE_ERROR, "journal_setup: Memory allocation failed.");
+        return -1;
+    }
+
+    for (int i = 0; i < num_disks; i++) {
+        if (fd_disks[i] < 0) continue;
+        meta_maps[i] = mmap(NULL, superblock.d_blocks_ptr, PROT_READ | PROT_WRITE, MAP_SHARED, fd_disks[i], 0);
+        if (meta_maps[i] == MAP_FAILED) {
+            TRACE(TRACE_ERROR, "journal_setup: Metadata mapping failed for disk %d: %s", i, strerror(errno));
+            return -1;
+        }
+    }
+    wb_meta_pages = superblock.d_blocks_ptr / page_size;
+
+    journal_replay();
+
+    for (int i = 0; i < num_disks; i++) {
+        if (fd_disks[i] < 0) continue;
+        if (mmap(disk_maps[i], superblock.d_blocks_ptr, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd_disks[i], 0) == MAP_FAILED) {
+            TRACE(TRACE_ERROR, "journal_setup: Private mapping failed for disk %d: %s", i, strerror(errno));
+            return -1;
+        }
+    }
+
+    // Writer preference, so a steady stream of operations cannot hold off
+    // the committer
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&journal_txn_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    journal_enabled = 1;
+    return 0;
+}
+
+// Inode cache
+//
+// An inode with open handles is pinned in memory: the first open pins it and
+// the last release unpins it. While it is pinned, load_inode and store_inode
+// use the cached copy and store_inode only marks it dirty, so the size, time
+// and block pointer updates of a run of writes reach the inode table on
+// every disk once. Dirty entries are written back when they are unpinned, on
+// fsync, and with the journal just before each commit, so a transaction
+// never carries blocks that its inode does not point to yet.
+//
+// Timestamps are lazier still. A store that changes nothing but timestamps,
+// and the access time of a read, stay in the entry until its last close or
+// an fsync, or until the inode is written back for another reason; a crash
+// can lose them but nothing else. Readers record the access time in the
+// entry's atime under the inode's read lock, so it is only updated
+// atomically and load_inode folds it into the inode it returns.
+//
+// Pinning and unpinning take the inode's write lock, and an entry's other
+// fields are guarded by the inode's lock like the on-disk inode. Entries are
+// kept once made, so an unlocked reader never sees one freed. icache_lock
+// guards the dirty list.
+#define ATIME_STRICT   0   // Every read
+#define ATIME_RELATIVE 1   // When older than the last change, or a day old
+#define ATIME_NONE     2
+#define RELATIME_SECS (24 * 60 * 60)
+
+struct icache_entry {
+    struct wfs_inode inode;
+    int pins;
+    int dirty;               // Changed beyond its timestamps, counted in the
+                             // running transaction
+    int lazy;                // Timestamps changed
+    time_t atime;            // Latest access recorded by a reader
+    time_t atime_written;    // Access time last written back
+    int listed;              // On icache_dirty
+};
+
+static struct icache_entry **icache;     // Indexed by inode number
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *icache_dirty = NULL;         // Inodes with changes to write back
+static int icache_ndirty = 0;
+static int icache_dirty_cap = 0;
+static int atime_mode = ATIME_RELATIVE;
+static uint64_t icache_stores = 0;       // Stores absorbed by a pinned entry
+static uint64_t icache_lazy_stores = 0;  // Of those, timestamp-only ones
+static uint64_t icache_atime_updates = 0;
+static uint64_t icache_write_backs = 0;
+
+static off_t inode_offset(int inode_num) {
+    return superblock.i_blocks_ptr + (off_t) inode_num * INODE_SIZE;
+}
+
+// Returns the inode's entry if it is pinned. Caller holds the inode's lock.
+static struct icache_entry *icache_find(int inode_num) {
+    struct icache_entry *e = __atomic_load_n(&icache[inode_num], __ATOMIC_ACQUIRE);
+    return e != NULL && __atomic_load_n(&e->pins, __ATOMIC_RELAXED) > 0 ? e : NULL;
+}
+
+static void inode_write_disks(int inode_num, const struct wfs_inode *inode) {
+    off_t offset = inode_offset(inode_num);
+    for (int i = 0; i < num_disks; i++) {
+        memcpy(disk_maps[i] + offset, inode, sizeof(struct wfs_inode));
+    }
+    journal_dirty_meta(offset, sizeof(struct wfs_inode));
+}
+
+// Puts an entry on the dirty list unless it is already there. Returns -1 if
+// the list cannot grow.
+static int icache_list(int inode_num, struct icache_entry *e) {
+    if (__atomic_exchange_n(&e->listed, 1, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    pthread_mutex_lock(&icache_lock);
+    if (icache_ndirty == icache_dirty_cap) {
+        int cap = icache_dirty_cap ? icache_dirty_cap * 2 : 64;
+        int *dirty = realloc(icache_dirty, cap * sizeof(int));
+        if (dirty == NULL) {
+            pthread_mutex_unlock(&icache_lock);
+            __atomic_store_n(&e->listed, 0, __ATOMIC_RELEASE);
+            return -1;
+        }
+        icache_dirty = dirty;
+        icache_dirty_cap = cap;
+    }
+    icache_dirty[icache_ndirty++] = inode_num;
+    pthread_mutex_unlock(&icache_lock);
+    return 0;
+}
+
+static int icache_pending(struct icache_entry *e) {
+    return e->dirty || e->lazy || __atomic_load_n(&e->atime, __ATOMIC_RELAXED) > e->atime_written;
+}
+
+// Writes an entry back if it is dirty, or with lazy set if only its
+// timestamps changed. The entry's inode is left alone, since a journal
+// commit writes back without the inode's lock. Caller holds the inode's
+// lock, or keeps every operation out.
+static void icache_write_back(int inode_num, struct icache_entry *e, int lazy) {
+    if (!e->dirty && !(lazy && icache_pending(e))) {
+        return;
+    }
+    struct wfs_inode inode;
+    memcpy(&inode, &e->inode, sizeof(inode));
+    time_t atime = __atomic_load_n(&e->atime, __ATOMIC_RELAXED);
+    if (atime > inode.atim) {
+        inode.atim = atime;
+    }
+    inode_write_disks(inode_num, &inode);
+    e->atime_written = inode.atim;
+    e->dirty = e->lazy = 0;
+    __atomic_fetch_add(&icache_write_backs, 1, __ATOMIC_RELAXED);
+}
+
+// Writes back every listed entry. The journal commit passes lock_inodes 0,
+// as it runs while no operation is in progress, and leaves entries with only
+// timestamp changes for later. Everyone else takes each inode's lock and
+// writes each inode back as its own operation.
+static void icache_flush(int lock_inodes) {
+    pthread_mutex_lock(&icache_lock);
+    int *dirty = icache_dirty;
+    int ndirty = icache_ndirty;
+    icache_dirty = NULL;
+    icache_ndirty = icache_dirty_cap = 0;
+    pthread_mutex_unlock(&icache_lock);
+
+    for (int i = 0; i < ndirty; i++) {
+        int inode_num = dirty[i];
+        struct icache_entry *e = icache[inode_num];
+        if (lock_inodes) {
+            journal_begin();
+            inode_wrlock(inode_num);
+        }
+        __atomic_store_n(&e->listed, 0, __ATOMIC_RELEASE);
+        icache_write_back(inode_num, e, lock_inodes);
+        if (e->pins > 0 && icache_pending(e)) {
+            // Left for later; should the list not take it, the last close
+            // still writes it back
+            icache_list(inode_num, e);
+        }
+        if (lock_inodes) {
+            inode_unlock(inode_num);
+            journal_end();
+        }
+    }
+    free(dirty);
+}
+
+// Writes back everything the cache holds, timestamps included
+void icache_sync(void) {
+    icache_flush(1);
+}
+
+// Pins an inode for an open file. Called without any inode lock held.
+void icache_pin(int inode_num) {
+    inode_wrlock(inode_num);
+    struct icache_entry *e = icache[inode_num];
+    if (e == NULL) {
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) {
+            // Stores go straight to the disks
+            inode_unlock(inode_num);
+            return;
+        }
+        __atomic_store_n(&icache[inode_num], e, __ATOMIC_RELEASE);
+    }
+    if (e->pins == 0) {
+        memcpy(&e->inode, disk_maps[0] + inode_offset(inode_num), sizeof(struct wfs_inode));
+        e->atime = e->atime_written = e->inode.atim;
+    }
+    __atomic_store_n(&e->pins, e->pins + 1, __ATOMIC_RELAXED);
+    inode_unlock(inode_num);
+}
+
+void icache_unpin(int inode_num) {
+    journal_begin();
+    inode_wrlock(inode_num);
+    struct icache_entry *e = icache[inode_num];
+    if (e != NULL && e->pins > 0) {
+        if (e->pins == 1) {
+            icache_write_back(inode_num, e, 1);
+        }
+        __atomic_store_n(&e->pins, e->pins - 1, __ATOMIC_RELAXED);
+    }
+    inode_unlock(inode_num);
+    journal_end();
+}
+
+// Records a read of an open inode under atime_mode. Caller holds the
+// inode's read lock and passes the inode as load_inode returned it.
+void inode_accessed(int inode_num, const struct wfs_inode *inode) {
+    if (atime_mode == ATIME_NONE) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (inode->atim >= now) {
+        return;
+    }
+    if (atime_mode == ATIME_RELATIVE && inode->atim > inode->mtim && inode->atim > inode->ctim &&
+        now - inode->atim < RELATIME_SECS) {
+        return;
+    }
+    struct icache_entry *e = icache_find(inode_num);
+    if (e == NULL) {
+        // Only without memory for an entry; the access goes unrecorded
+        return;
+    }
+    time_t old = __atomic_load_n(&e->atime, __ATOMIC_RELAXED);
+    while (old < now && !__atomic_compare_exchange_n(&e->atime, &old, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&icache_atime_updates, 1, __ATOMIC_RELAXED);
+    icache_list(inode_num, e);
+}
+
+// Inode operations
+int load_inode(int inode_num, struct wfs_inode *inode) {
+    struct icache_entry *e = icache_find(inode_num);
+    if (e != NULL) {
+        memcpy(inode, &e->inode, sizeof(struct wfs_inode));
+        time_t atime = __atomic_load_n(&e->atime, __ATOMIC_RELAXED);
+        if (atime > inode->atim) {
+            inode->atim = atime;
+        }
+        return 0;
+    }
+    memcpy(inode, disk_maps[0] + inode_offset(inode_num), sizeof(struct wfs_inode));
+    TRACE(TRACE_DEBUG, "load_inode: Loaded inode %d at offset %ld", inode_num, inode_offset(inode_num));
+    return 0;
+}
+
+// True if the two differ in nothing but their timestamps
+static int inode_same_but_times(const struct wfs_inode *a, const struct wfs_inode *b) {
+    return a->num == b->num && a->mode == b->mode && a->uid == b->uid && a->gid == b->gid &&
+           a->size == b->size && a->nlinks == b->nlinks && a->flags == b->flags && a->nblocks == b->nblocks &&
+           memcmp(a->blocks, b->blocks, sizeof(a->blocks)) == 0 &&
+           a->dind_block == b->dind_block && a->tind_block == b->tind_block;
+}
+
+// Caller holds the inode's write lock
+int store_inode(int inode_num, struct wfs_inode *inode) {
+    struct icache_entry *e = icache_find(inode_num);
+    if (e == NULL) {
+        inode_write_disks(inode_num, inode);
+        TRACE(TRACE_DEBUG, "store_inode: Stored inode %d at offset %ld on all disks", inode_num, inode_offset(inode_num));
+        return 0;
+    }
+
+    int times_only = inode_same_but_times(&e->inode, inode);
+    memcpy(&e->inode, inode, sizeof(struct wfs_inode));
+    __atomic_fetch_add(&icache_stores, 1, __ATOMIC_RELAXED);
+    if (times_only) {
+        __atomic_fetch_add(&icache_lazy_stores, 1, __ATOMIC_RELAXED);
+        e->lazy = 1;
+    } else if (!e->dirty) {
+        e->dirty = 1;
+        if (journal_enabled) {
+            // Counted in the running transaction now, written at its commit
+            journal_dirty_meta(inode_offset(inode_num), sizeof(struct wfs_inode));
+        }
+    }
+    if (icache_list(inode_num, e) != 0) {
+        icache_write_back(inode_num, e, 1);
+    }
+    TRACE(TRACE_DEBUG, "store_inode: Cached inode %d until write-back", inode_num);
+    return 0;
+}
+
+// Inline data
+//
+// On images with WFS_FEATURE_INLINE_DATA new files and directories start out
+// with WFS_INODE_INLINE set and keep their contents in the INLINE_MAX bytes
+// that follow struct wfs_inode in the inode's slot. Those bytes are metadata
+// like the inode itself, written to every disk and journaled with it, so a
+// small file costs no data block and no data write. A file moves to data
+// blocks once a write or fallocate reaches past INLINE_MAX, a directory once
+// its inline slots are all taken; neither moves back. The root directory
+// always uses blocks.
+static int inline_enabled = 0;
+static int block_count_enabled = 0;   // Inodes carry nblocks, see wfs_getattr
+
+static int inode_is_inline(const struct wfs_inode *inode) {
+    return inline_enabled && (inode->flags & WFS_INODE_INLINE);
+}
+
+static off_t inline_offset(int inode_num) {
+    return inode_offset(inode_num) + sizeof(struct wfs_inode);
+}
+
+// Caller holds the inode's lock
+void inline_read(int inode_num, void *buf, off_t offset, size_t len) {
+    memcpy(buf, disk_maps[0] + inline_offset(inode_num) + offset, len);
+}
+
+// Caller holds the inode's write lock. A NULL buf writes zeroes.
+void inline_write(int inode_num, const void *buf, off_t offset, size_t len) {
+    off_t start = inline_offset(inode_num) + offset;
+    for (int i = 0; i < num_disks; i++) {
+        if (buf != NULL) {
+            memcpy(disk_maps[i] + start, buf, len);
+        } else {
+            memset(disk_maps[i] + start, 0, len);
+        }
+    }
+    journal_dirty_meta(start, len);
+}
+
+// Bitmap allocation
+//
+// The bitmaps are scanned a 64-bit word at a time starting from a next-fit
+// cursor, so a run of allocations does not rescan the blocks it just handed
+// out. Free counts are kept alongside so a full bitmap fails in O(1). Blocks
+// held in preallocation windows are marked in reserved_map, which only lives
+// in memory, so a crash cannot leave them allocated on disk. All of this
+// state is guarded by bitmap_lock.
+static int inode_cursor = 0;
+static int data_cursor = 1;
+static int free_inode_count = 0;
+static int free_data_count = 0;
+static char *reserved_map = NULL;
+
+// Loads the 64 bits starting at bit index (a multiple of 64), limited to the
+// bytes that belong to a bitmap of nbits bits. Missing bits read as zero.
+static uint64_t load_bitmap_word(const char *bitmap, int index, int nbits) {
+    uint64_t word = 0;
+    int nbytes = (nbits - index + 7) / 8;
+    if (nbytes >= 8) {
+        memcpy(&word, bitmap + index / 8, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        return word;
+    }
+    for (int b = 0; b < nbytes; b++) {
+        word |= (uint64_t)(unsigned char)bitmap[index / 8 + b] << (8 * b);
+    }
+    return word;
+}
+
+// Returns the first bit in [start, end) that is clear in bitmap and, if
+// given, in reserved, or -1. Adds the words it looked at to *words.
+static int find_clear_bit(const char *bitmap, const char *reserved, int start, int end, int nbits, int *words) {
+    int index = start & ~63;
+    while (index < end) {
+        (*words)++;
+        uint64_t used = load_bitmap_word(bitmap, index, nbits);
+        if (reserved != NULL) {
+            used |= load_bitmap_word(reserved, index, nbits);
+        }
+        uint64_t free_bits = ~used;
+        if (index < start) {
+            free_bits &= ~0ULL << (start - index);
+        }
+        if (free_bits) {
+            int bit = index + __builtin_ctzll(free_bits);
+            return bit < end ? bit : -1;
+        }
+        index += 64;
+    }
+    return -1;
+}
+
+// Next-fit search from *cursor, wrapping around to first. The scan length
+// goes into scan.
+static int find_free_bit(const char *bitmap, const char *reserved, int first, int nbits, int *cursor,
+                         struct stat_hist *scan) {
+    int start = *cursor < first || *cursor >= nbits ? first : *cursor;
+    int words = 0;
+    int bit = find_clear_bit(bitmap, reserved, start, nbits, nbits, &words);
+    if (bit < 0 && start > first) {
+        bit = find_clear_bit(bitmap, reserved, first, start, nbits, &words);
+    }
+    stat_hist_add(scan, words);
+    if (bit >= 0) {
+        *cursor = bit + 1;
+    }
+    return bit;
+}
+
+static int count_clear_bits(const char *bitmap, int first, int nbits) {
+    int used = 0;
+    for (int index = 0; index < nbits; index += 64) {
+        uint64_t word = load_bitmap_word(bitmap, index, nbits);
+        if (nbits - index < 64) {
+            word |= ~0ULL << (nbits - index);
+        }
+        if (index < first) {
+            word |= ~(~0ULL << (first - index));
+        }
+        used += __builtin_popcountll(word);
+    }
+    return nbits - used;
+}
+
+// Rebuilds the free counts from disk 0; called once the disks are in order
+void bitmap_init_summary(void) {
+    pthread_mutex_lock(&bitmap_lock);
+    free_inode_count = count_clear_bits(disk_maps[0] + superblock.i_bitmap_ptr, 0, superblock.num_inodes);
+    free_data_count = count_clear_bits(disk_maps[0] + superblock.d_bitmap_ptr, 1, superblock.num_data_blocks);
+    inode_cursor = 0;
+    data_cursor = 1;
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_INFO, "bitmap_init_summary: %d free inodes, %d free data blocks",
+            free_inode_count, free_data_count);
+}
+
+int allocate_inode(void) {
+    pthread_mutex_lock(&bitmap_lock);
+    char *inode_bitmap = disk_maps[0] + superblock.i_bitmap_ptr;
+    int i = free_inode_count > 0 ? find_free_bit(inode_bitmap, NULL, 0, superblock.num_inodes, &inode_cursor, &inode_scan_stats) : -1;
+    if (i < 0) {
+        pthread_mutex_unlock(&bitmap_lock);
+        TRACE(TRACE_ERROR, "allocate_inode: No free inodes available");
+        return -ENOSPC;
+    }
+    set_bit(inode_bitmap, i);
+    // Mirror the bitmap to other disks
+    for (int j = 1; j < num_disks; j++) {
+        set_bit(disk_maps[j] + superblock.i_bitmap_ptr, i);
+    }
+    journal_dirty_meta(superblock.i_bitmap_ptr + i / 8, 1);
+    free_inode_count--;
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_DEBUG, "allocate_inode: Allocated inode %d", i);
+    return i;
+}
+
+void free_inode(int inode_num) {
+    pthread_mutex_lock(&bitmap_lock);
+    if (get_bit(disk_maps[0] + superblock.i_bitmap_ptr, inode_num)) {
+        free_inode_count++;
+    }
+    clear_bit(disk_maps[0] + superblock.i_bitmap_ptr, inode_num);
+    for (int i = 1; i < num_disks; i++) {
+        clear_bit(disk_maps[i] + superblock.i_bitmap_ptr, inode_num);
+    }
+    journal_dirty_meta(superblock.i_bitmap_ptr + inode_num / 8, 1);
+    pthread_mutex_unlock(&bitmap_lock);
+    dir_free_hint[inode_num] = 0;
+    TRACE(TRACE_DEBUG, "free_inode: Freed inode %d", inode_num);
+}
+
+// Data block operations
+
+// Sets a block's bit; caller holds bitmap_lock and adjusts free_data_count
+static void set_data_bit_locked(int block_num) {
+    set_bit(disk_maps[0] + superblock.d_bitmap_ptr, block_num);
+    // Mirror the bitmap to other disks (all modes but RAID 0)
+    if (raid_mode != 0) {
+        for (int j = 1; j < num_disks; j++) {
+            set_bit(disk_maps[j] + superblock.d_bitmap_ptr, block_num);
+        }
+    }
+    journal_dirty_meta(superblock.d_bitmap_ptr + block_num / 8, 1);
+}
+
+// Caller holds bitmap_lock
+static void mark_data_block_locked(int block_num) {
+    set_data_bit_locked(block_num);
+    free_data_count--;
+}
+
+int allocate_data_block(void) {
+    pthread_mutex_lock(&bitmap_lock);
+    char *data_bitmap = disk_maps[0] + superblock.d_bitmap_ptr;
+    // Start from block 1; block 0 is the null block pointer
+    int i = free_data_count > 0 ? find_free_bit(data_bitmap, reserved_map, 1, superblock.num_data_blocks, &data_cursor, &data_scan_stats) : -1;
+    if (i < 0) {
+        pthread_mutex_unlock(&bitmap_lock);
+        TRACE(TRACE_ERROR, "allocate_data_block: No free data blocks available");
+        return -ENOSPC;
+    }
+    mark_data_block_locked(i);
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_DEBUG, "allocate_data_block: Allocated data block %d", i);
+    return i;
+}
+
+// Caller holds bitmap_lock
+static void clear_data_bit_locked(int block_num) {
+    if (get_bit(disk_maps[0] + superblock.d_bitmap_ptr, block_num)) {
+        free_data_count++;
+    }
+    clear_bit(disk_maps[0] + superblock.d_bitmap_ptr, block_num);
+    if (raid_mode != 0) {
+        for (int i = 1; i < num_disks; i++) {
+            clear_bit(disk_maps[i] + superblock.d_bitmap_ptr, block_num);
+        }
+    }
+    journal_dirty_meta(superblock.d_bitmap_ptr + block_num / 8, 1);
+}
+
+void free_data_block(int block_num) {
+    pthread_mutex_lock(&bitmap_lock);
+    clear_data_bit_locked(block_num);
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_DEBUG, "free_data_block: Freed data block %d", block_num);
+}
+
+// Frees n data blocks in one pass over the bitmap
+void free_data_blocks(const off_t *blocks, int n) {
+    pthread_mutex_lock(&bitmap_lock);
+    for (int i = 0; i < n; i++) {
+        clear_data_bit_locked(blocks[i]);
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_DEBUG, "free_data_blocks: Freed %d data blocks", n);
+}
+
+// Frees data blocks a file no longer maps. Data writes skip the journal, so
+// with it on the blocks wait for the commit that unmaps them, like
+// free_meta_block's; otherwise a replay could hand the file back a block
+// some other file has since written.
+void free_file_blocks(const off_t *blocks, int n) {
+    if (!journal_enabled) {
+        free_data_blocks(blocks, n);
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    journal_defer_frees_locked(blocks, n);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Contiguous allocation
+//
+// With alloc=contig (the default) a file's next block goes right after its
+// previous one when that block is free, and each open file reserves a window
+// of the blocks that follow (prealloc=N, default 8) so files written at the
+// same time do not interleave. alloc=nextfit uses the plain next-fit cursor.
+#define ALLOC_NEXTFIT 0
+#define ALLOC_CONTIG  1
+
+static int alloc_policy = ALLOC_CONTIG;
+static int prealloc_blocks = 8;
+
+// Allocates goal if it is free, otherwise the first free block after it
+// (wrapping around). A goal of 0 means no preference.
+int allocate_data_block_near(int goal) {
+    if (alloc_policy != ALLOC_CONTIG || goal <= 0 || goal >= (int) superblock.num_data_blocks) {
+        return allocate_data_block();
+    }
+    pthread_mutex_lock(&bitmap_lock);
+    int cursor = goal;
+    int i = free_data_count > 0 ? find_free_bit(disk_maps[0] + superblock.d_bitmap_ptr, reserved_map, 1, superblock.num_data_blocks,
+                                                 &cursor, &data_scan_stats) : -1;
+    if (i < 0) {
+        pthread_mutex_unlock(&bitmap_lock);
+        TRACE(TRACE_ERROR, "allocate_data_block_near: No free data blocks available");
+        return -ENOSPC;
+    }
+    mark_data_block_locked(i);
+    pthread_mutex_unlock(&bitmap_lock);
+    TRACE(TRACE_DEBUG, "allocate_data_block_near: Allocated data block %d (goal %d)", i, goal);
+    return i;
+}
+
+// Reserves up to max free blocks directly following start. Returns how many
+// were reserved; no allocation hands them out until they are claimed or
+// released, but they stay clear in the on-disk bitmap.
+int reserve_data_run(int start, int max) {
+    pthread_mutex_lock(&bitmap_lock);
+    char *data_bitmap = disk_maps[0] + superblock.d_bitmap_ptr;
+    int n = 0;
+    while (n < max && start + 1 + n < (int) superblock.num_data_blocks &&
+           !get_bit(data_bitmap, start + 1 + n) && !get_bit(reserved_map, start + 1 + n)) {
+        set_bit(reserved_map, start + 1 + n);
+        free_data_count--;
+        n++;
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    return n;
+}
+
+// Turns a reserved block into an allocated one
+void claim_reserved_block(int block_num) {
+    pthread_mutex_lock(&bitmap_lock);
+    clear_bit(reserved_map, block_num);
+    set_data_bit_locked(block_num);
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+void release_reserved_block(int block_num) {
+    pthread_mutex_lock(&bitmap_lock);
+    clear_bit(reserved_map, block_num);
+    free_data_count++;
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+// Open file table
+//
+// One entry per open inode, shared by every handle on it and stored in
+// fi->fh, so the data path can go from handle to blocks without resolving the
+// path. The entry also keeps a copy of the inode's indirect pointer block,
+// and of the last pointer block used below the double or triple indirect
+// block (the leaf), so sequential access reads each of those only once.
+//
+// The table itself is guarded by open_files_lock. The indirect block copy is
+// guarded by the inode lock; readers share that lock, so filling the copy
+// additionally takes ind_lock. The leaf copy changes on reads too and is
+// only used with leaf_lock held.
+struct wfs_open_file {
+    int inode_num;
+    int refcount;
+    int ind_valid;     // indirect_pointers matches the on-disk indirect block
+    pthread_mutex_t ind_lock;
+    off_t prealloc_start;  // Reserved blocks for the next writes, guarded by
+    int prealloc_len;      // the inode write lock
+    off_t *indirect_pointers;  // ptrs_per_block entries each, allocated with
+    pthread_mutex_t leaf_lock;
+    off_t leaf_block;  // Pointer block held in leaf_pointers, 0 if none
+    int leaf_first;    // First file block it maps
+    int leaf_dirty;    // leaf_pointers has changes not yet written
+    off_t *leaf_pointers;      // the entry
+    struct wfs_open_file *next;
+};
+
+static struct wfs_open_file *open_files = NULL;
+
+// Caller holds open_files_lock
+static struct wfs_open_file *open_file_find_locked(int inode_num) {
+    for (struct wfs_open_file *of = open_files; of != NULL; of = of->next) {
+        if (of->inode_num == inode_num) return of;
+    }
+    return NULL;
+}
+
+// Returns the open file for an inode with a reference taken, or NULL when it
+// is not open (or, with create set, when allocation fails)
+struct wfs_open_file *open_file_get(int inode_num, int create) {
+    pthread_mutex_lock(&open_files_lock);
+    struct wfs_open_file *of = open_file_find_locked(inode_num);
+    if (of) {
+        of->refcount++;
+    } else if (create) {
+        of = calloc(1, sizeof(struct wfs_open_file) + 2 * (size_t) block_size);
+        if (of) {
+            of->indirect_pointers = (off_t *)(of + 1);
+            of->leaf_pointers = of->indirect_pointers + ptrs_per_block;
+            of->inode_num = inode_num;
+            of->refcount = 1;
+            pthread_mutex_init(&of->ind_lock, NULL);
+            pthread_mutex_init(&of->leaf_lock, NULL);
+            of->next = open_files;
+            open_files = of;
+        }
+        pthread_mutex_unlock(&open_files_lock);
+        if (of) {
+            icache_pin(inode_num);
+        }
+        return of;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return of;
+}
+
+// Returns the unused part of the preallocation window to the free pool
+void open_file_drop_prealloc(struct wfs_open_file *of) {
+    for (int i = 0; i < of->prealloc_len; i++) {
+        release_reserved_block(of->prealloc_start + i);
+    }
+    of->prealloc_len = 0;
+}
+
+void open_file_put(struct wfs_open_file *of) {
+    pthread_mutex_lock(&open_files_lock);
+    if (--of->refcount > 0) {
+        pthread_mutex_unlock(&open_files_lock);
+        return;
+    }
+    for (struct wfs_open_file **pp = &open_files; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == of) {
+            *pp = of->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    open_file_drop_prealloc(of);
+    icache_unpin(of->inode_num);
+    pthread_mutex_destroy(&of->ind_lock);
+    pthread_mutex_destroy(&of->leaf_lock);
+    free(of);
+}
+
+// Forget the cached pointer blocks of an inode whose block map was changed
+// outside of the open file's view (e.g. its blocks were freed). Caller holds
+// the inode's write lock.
+void open_file_invalidate(int inode_num) {
+    pthread_mutex_lock(&open_files_lock);
+    struct wfs_open_file *of = open_file_find_locked(inode_num);
+    if (of) {
+        of->ind_valid = 0;
+        of->leaf_block = 0;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+}
+
+// Finds the open file a read or write applies to: straight from the handle
+// when there is one, otherwise by resolving the path. Returns with a reference
+// held that must be dropped with release_open_file.
+int resolve_open_file(const char *path, struct fuse_file_info *fi, struct wfs_open_file **ofp);
+void release_open_file(struct fuse_file_info *fi, struct wfs_open_file *of);
+
+// Indirect Block Helper Functions
+
+int read_indirect_pointers(struct wfs_inode *inode, off_t *indirect_pointers) {
+    if (inode->blocks[IND_BLOCK] == 0) {
+        return -ENOENT; // Indirect block not allocated
+    }
+
+    char buf[block_size];
+    ssize_t res = meta_read_block(buf, inode->blocks[IND_BLOCK]);
+    if (res != block_size) {
+        TRACE(TRACE_ERROR, "read_indirect_pointers: Failed to read indirect block %ld", inode->blocks[IND_BLOCK]);
+        return -EIO; // I/O error
+    }
+
+    memcpy(indirect_pointers, buf, block_size);
+    return 0;
+}
+
+int write_indirect_pointers(struct wfs_inode *inode, off_t *indirect_pointers) {
+    if (inode->blocks[IND_BLOCK] == 0) {
+        return -ENOENT; // Indirect block not allocated
+    }
+
+    char buf[block_size];
+    memcpy(buf, indirect_pointers, block_size);
+    ssize_t res = meta_write_block(buf, inode->blocks[IND_BLOCK]);
+    if (res != block_size) {
+        TRACE(TRACE_ERROR, "write_indirect_pointers: Failed to write indirect block %ld", inode->blocks[IND_BLOCK]);
+        return -EIO; // I/O error
+    }
+
+    return 0;
+}
+
+// Returns the inode's indirect pointers, reading the indirect block only if
+// the open file does not already hold a copy of it
+off_t *open_file_indirect(struct wfs_open_file *of, struct wfs_inode *inode) {
+    if (__atomic_load_n(&of->ind_valid, __ATOMIC_ACQUIRE)) {
+        return of->indirect_pointers;
+    }
+    pthread_mutex_lock(&of->ind_lock);
+    if (!of->ind_valid) {
+        if (read_indirect_pointers(inode, of->indirect_pointers) != 0) {
+            pthread_mutex_unlock(&of->ind_lock);
+            return NULL;
+        }
+        __atomic_store_n(&of->ind_valid, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&of->ind_lock);
+    return of->indirect_pointers;
+}
+
+// Allocates the data block for a file block whose predecessor in the file is
+// prev (0 if none). Blocks continuing the file come from the open file's
+// preallocation window, which is refilled behind each fresh allocation.
+// Caller holds the inode write lock.
+int allocate_file_block(struct wfs_open_file *of, off_t prev) {
+    if (of->prealloc_len > 0) {
+        if (prev == 0 || of->prealloc_start == prev + 1) {
+            of->prealloc_len--;
+            claim_reserved_block(of->prealloc_start);
+            return of->prealloc_start++;
+        }
+        open_file_drop_prealloc(of);
+    }
+
+    int block_num = allocate_data_block_near(prev ? prev + 1 : 0);
+    if (block_num < 0 || alloc_policy != ALLOC_CONTIG || prealloc_blocks <= 1) {
+        return block_num;
+    }
+    of->prealloc_start = block_num + 1;
+    of->prealloc_len = reserve_data_run(block_num, prealloc_blocks - 1);
+    return block_num;
+}
+
+// Allocates a zero-filled pointer block. Returns its number or an error.
+static int allocate_pointer_block(void) {
+    int block_num = allocate_data_block();
+    if (block_num < 0) {
+        return block_num; // Propagate error
+    }
+
+    char zero_block[block_size];
+    memset(zero_block, 0, block_size);
+    ssize_t res = meta_write_block(zero_block, block_num);
+    if (res != block_size) {
+        TRACE(TRACE_ERROR, "allocate_pointer_block: Failed to initialize pointer block %d", block_num);
+        free_meta_block(block_num); // Free allocated block on failure
+        return -EIO; // I/O error
+    }
+    return block_num;
+}
+
+int allocate_indirect_block(struct wfs_inode *inode) {
+    if (inode->blocks[IND_BLOCK] != 0) {
+        // Indirect block already allocated
+        return 0;
+    }
+
+    int block_num = allocate_pointer_block();
+    if (block_num < 0) {
+        return block_num; // Propagate error
+    }
+    inode->blocks[IND_BLOCK] = block_num;
+
+    // Persist the updated inode
+    store_inode(inode->num, inode);
+    TRACE(TRACE_DEBUG, "allocate_indirect_block: Allocated indirect block %d for inode %d", block_num, inode->num);
+
+    return 0;
+}
+
+// Large files
+//
+// On images with WFS_FEATURE_LARGE_FILE, file blocks past the single
+// indirect range go through the double indirect block (ptrs_per_block^2
+// blocks) and then the triple indirect block (ptrs_per_block^3). The
+// pointer blocks of both trees are allocated as they are first needed. Older
+// images keep the direct + single indirect limit.
+#define DIND_FIRST (D_BLOCK + ptrs_per_block)
+#define TIND_FIRST (DIND_FIRST + ptrs_per_block * ptrs_per_block)
+
+static int max_file_blocks = D_BLOCK + INDIRECT_BLOCK_ENTRIES;   // Set in main
+
+// Follows the pointer blocks from *root through the slots in idx[0..levels)
+// and returns the block reached, 0 at a hole, or an error. With alloc set,
+// missing pointer blocks are allocated on the way (the inode is stored if
+// *root was one of them).
+static off_t walk_pointer_blocks(struct wfs_inode *inode, off_t *root, const int *idx, int levels, int alloc) {
+    if (*root == 0) {
+        if (!alloc) return 0;
+        int block_num = allocate_pointer_block();
+        if (block_num < 0) return block_num;
+        *root = block_num;
+        store_inode(inode->num, inode);
+    }
+    off_t block = *root;
+    for (int level = 0; level < levels; level++) {
+        off_t pointers[ptrs_per_block];
+        if (meta_read_block(pointers, block) != block_size) {
+            return -EIO;
+        }
+        if (pointers[idx[level]] == 0) {
+            if (!alloc) return 0;
+            int block_num = allocate_pointer_block();
+            if (block_num < 0) return block_num;
+            pointers[idx[level]] = block_num;
+            ssize_t res = meta_write_block(pointers, block);
+            if (res != block_size) {
+                // The new block is not linked in, so nothing may use it
+                TRACE(TRACE_ERROR, "walk_pointer_blocks: Failed to link pointer block %d into block %ld", block_num, block);
+                free_meta_block(block_num);
+                return res < 0 ? res : -EIO;
+            }
+        }
+        block = pointers[idx[level]];
+    }
+    return block;
+}
+
+// Writes the open file's leaf back if it changed. Caller holds leaf_lock.
+static int open_file_flush_leaf(struct wfs_open_file *of) {
+    if (!of->leaf_dirty) {
+        return 0;
+    }
+    of->leaf_dirty = 0;
+    if (meta_write_block(of->leaf_pointers, of->leaf_block) != block_size) {
+        TRACE(TRACE_ERROR, "open_file_flush_leaf: Failed to write pointer block %ld", of->leaf_block);
+        return -EIO;
+    }
+    return 0;
+}
+
+// Returns the pointer slot for file block block_index (at least DIND_FIRST),
+// loading the leaf holding it into the open file unless it is already
+// there. Returns NULL at a hole, or on error with *err set. Caller holds
+// leaf_lock.
+static off_t *open_file_leaf(struct wfs_open_file *of, struct wfs_inode *inode, int block_index, int alloc, int *err) {
+    int n = ptrs_per_block;
+    int rel = block_index - DIND_FIRST;
+    if (of->leaf_block != 0 && block_index >= of->leaf_first && block_index < of->leaf_first + n) {
+        return &of->leaf_pointers[block_index - of->leaf_first];
+    }
+
+    int idx[2], levels;
+    off_t *root;
+    if (block_index < TIND_FIRST) {
+        root = &inode->dind_block;
+        idx[0] = rel / n;
+        levels = 1;
+    } else {
+        rel = block_index - TIND_FIRST;
+        root = &inode->tind_block;
+        idx[0] = rel / (n * n);
+        idx[1] = rel / n % n;
+        levels = 2;
+    }
+
+    *err = open_file_flush_leaf(of);
+    if (*err != 0) return NULL;
+    of->leaf_block = 0;
+    off_t leaf = walk_pointer_blocks(inode, root, idx, levels, alloc);
+    if (leaf <= 0) {
+        *err = (int) leaf;
+        return NULL;
+    }
+    if (meta_read_block(of->leaf_pointers, leaf) != block_size) {
+        *err = -EIO;
+        return NULL;
+    }
+    of->leaf_block = leaf;
+    of->leaf_first = block_index - rel % n;
+    return &of->leaf_pointers[rel % n];
+}
+
+// Truncation
+//
+// Shrinking a file frees everything past the new last block in one walk of
+// its block map: each pointer block is read and rewritten (or freed) once,
+// and the data blocks are released FREE_BATCH at a time under a single
+// lock (see free_file_blocks).
+#define FREE_BATCH 256
+
+struct free_batch {
+    int n;
+    uint32_t freed;    // Blocks added since the batch was set up
+    off_t blocks[FREE_BATCH];
+};
+
+static void free_batch_flush(struct free_batch *batch) {
+    if (batch->n > 0) {
+        free_file_blocks(batch->blocks, batch->n);
+        batch->n = 0;
+    }
+}
+
+static void free_batch_add(struct free_batch *batch, off_t block) {
+    if (batch->n == FREE_BATCH) {
+        free_batch_flush(batch);
+    }
+    batch->blocks[batch->n++] = block;
+    batch->freed++;
+}
+
+// Frees what the pointer block (levels of pointer blocks above the data
+// blocks) maps from its file block keep on. Returns 1 when nothing below it
+// is left, in which case the block itself has been freed as well.
+static int truncate_pointer_tree(off_t block, int levels, long keep, struct free_batch *batch) {
+    off_t pointers[ptrs_per_block];
+    if (meta_read_block(pointers, block) != block_size) {
+        // Leaking the tree is safe, freeing blocks still in use is not
+        TRACE(TRACE_ERROR, "truncate_pointer_tree: Failed to read pointer block %ld", block);
+        return 0;
+    }
+    long span = 1;   // File blocks per entry
+    for (int level = 1; level < levels; level++) {
+        span *= ptrs_per_block;
+    }
+
+    int changed = 0, live = 0;
+    for (int i = 0; i < ptrs_per_block; i++) {
+        long start = i * span;
+        if (pointers[i] == 0) continue;
+        if (start + span <= keep) {
+            live = 1;
+        } else if (levels == 1) {
+            free_batch_add(batch, pointers[i]);
+            pointers[i] = 0;
+            changed = 1;
+        } else if (truncate_pointer_tree(pointers[i], levels - 1, keep > start ? keep - start : 0, batch)) {
+            pointers[i] = 0;
+            changed = 1;
+        } else {
+            live = 1;
+        }
+    }
+
+    if (!live) {
+        free_meta_block(block);
+        return 1;
+    }
+    if (changed && meta_write_block(pointers, block) != block_size) {
+        TRACE(TRACE_ERROR, "truncate_pointer_tree: Failed to write pointer block %ld", block);
+    }
+    return 0;
+}
+
+// Frees the data blocks of file blocks keep and up, and the pointer blocks
+// left mapping nothing. Caller holds the inode's write lock and stores the
+// inode.
+static void truncate_file_blocks(struct wfs_inode *inode, long keep) {
+    struct free_batch batch;
+    batch.n = 0;
+    batch.freed = 0;
+    for (long i = keep; i < D_BLOCK; i++) {
+        if (inode->blocks[i] != 0) {
+            free_batch_add(&batch, inode->blocks[i]);
+            inode->blocks[i] = 0;
+        }
+    }
+    if (inode->blocks[IND_BLOCK] != 0 &&
+        truncate_pointer_tree(inode->blocks[IND_BLOCK], 1, keep > D_BLOCK ? keep - D_BLOCK : 0, &batch)) {
+        inode->blocks[IND_BLOCK] = 0;
+    }
+    if (inode->dind_block != 0 &&
+        truncate_pointer_tree(inode->dind_block, 2, keep > DIND_FIRST ? keep - DIND_FIRST : 0, &batch)) {
+        inode->dind_block = 0;
+    }
+    if (inode->tind_block != 0 &&
+        truncate_pointer_tree(inode->tind_block, 3, keep > TIND_FIRST ? keep - TIND_FIRST : 0, &batch)) {
+        inode->tind_block = 0;
+    }
+    free_batch_flush(&batch);
+    inode->nblocks = batch.freed < inode->nblocks ? inode->nblocks - batch.freed : 0;
+    open_file_invalidate(inode->num);
+    TRACE(TRACE_DEBUG, "truncate_file_blocks: Freed the blocks of inode %d from block %ld on", inode->num, keep);
+}
+
+// Extent mapping
+//
+// Reads and writes map the whole byte range to data block numbers up front
+// (at most EXTENT_BATCH at a time) and then copy each run of consecutive
+// block numbers with a single raid_*_extent call.
+#define EXTENT_BATCH    64
+
+// map_file_blocks modes
+#define MAP_LOOKUP 0   // stop at the first hole
+#define MAP_ALLOC  1   // allocate missing blocks
+#define MAP_ZERO   2   // allocate missing blocks and zero-fill them
+#define MAP_HOLES  3   // map holes to block 0
+#define MAP_PUNCH  4   // free mapped blocks, leaving holes (all map to 0)
+
+// Fills blocks[] with the data blocks backing file blocks [first, first + count).
+// With MAP_ALLOC or MAP_ZERO, missing blocks are allocated; changed pointer
+// blocks are written back once at the end. Returns the number of leading
+// blocks mapped; it is short at the first hole (MAP_LOOKUP) or on error,
+// reported in *err.
+int map_file_blocks(struct wfs_inode *inode, struct wfs_open_file *of, int first, int count,
+                    off_t *blocks, int mode, int *err) {
+    int alloc = mode == MAP_ALLOC || mode == MAP_ZERO;
+    int holes = mode == MAP_HOLES || mode == MAP_PUNCH;
+    int ind_dirty = 0;
+    int mapped = 0;
+    off_t prev = 0;   // Block backing file block first - 1, the allocation goal
+    int large = first + count > DIND_FIRST;
+    *err = 0;
+
+    if (large) {
+        pthread_mutex_lock(&of->leaf_lock);
+    }
+    if (alloc && first > 0) {
+        if (first - 1 < D_BLOCK) {
+            prev = inode->blocks[first - 1];
+        } else if (first - 1 >= DIND_FIRST) {
+            int ignored;
+            off_t *ptr = open_file_leaf(of, inode, first - 1, MAP_LOOKUP, &ignored);
+            if (ptr) prev = *ptr;
+        } else if (inode->blocks[IND_BLOCK] != 0) {
+            off_t *indirect_pointers = open_file_indirect(of, inode);
+            if (indirect_pointers) prev = indirect_pointers[first - 1 - D_BLOCK];
         }
     }
-    printf("[DEBUG] dump_data_bitmap_comparison: Completed\n");
-}
 
-// RAID functions
-ssize_t raid_read(void *buf, off_t block_number, size_t size) {
-    if (raid_mode == 0) {
-        // RAID 0
-        int stripe_index = block_number / num_disks;
-        int disk_idx = block_number % num_disks;
-        off_t disk_offset = superblock.d_blocks_ptr + stripe_index * BLOCK_SIZE;
-        memcpy(buf, disk_maps[disk_idx] + disk_offset, size);
-    } else if (raid_mode == 1) {
-        // RAID 1
-        memcpy(buf, disk_maps[0] + superblock.d_blocks_ptr + block_number * BLOCK_SIZE, size);
-    } else if (raid_mode == 2) {
-        // RAID 1v (Majority Voting)
-        char temp_buf[MAX_DISKS][BLOCK_SIZE];
-        int counts[MAX_DISKS] = {0};
-        for (int i = 0; i < num_disks; i++) {
-            memcpy(temp_buf[i], disk_maps[i] + superblock.d_blocks_ptr + block_number * BLOCK_SIZE, size);
-        }
-        // Majority voting
-        for (int i = 0; i < num_disks; i++) {
-            for (int j = i + 1; j < num_disks; j++) {
-                if (memcmp(temp_buf[i], temp_buf[j], size) == 0) {
-                    counts[i]++;
-                    counts[j]++;
+    for (; mapped < count; mapped++) {
+        int block_index = first + mapped;
+        off_t *ptr;
+
+        if (block_index < D_BLOCK) {
+            ptr = &inode->blocks[block_index];
+        } else if (block_index >= DIND_FIRST) {
+            ptr = open_file_leaf(of, inode, block_index, alloc, err);
+            if (ptr == NULL) {
+                if (*err != 0 || !holes) break;
+                // No pointer block, so a hole
+                blocks[mapped] = 0;
+                continue;
+            }
+        } else {
+            if (inode->blocks[IND_BLOCK] == 0) {
+                if (holes) {
+                    blocks[mapped] = 0;
+                    continue;
                 }
+                if (!alloc) break;
+                *err = allocate_indirect_block(inode);
+                if (*err != 0) break;
+                // Freshly zeroed, no need to read it back
+                memset(of->indirect_pointers, 0, block_size);
+                of->ind_valid = 1;
+            }
+            off_t *indirect_pointers = open_file_indirect(of, inode);
+            if (indirect_pointers == NULL) {
+                *err = -EIO;
+                break;
             }
+            ptr = &indirect_pointers[block_index - D_BLOCK];
         }
-        // Find the data with the highest count
-        int max_idx = 0;
-        for (int i = 1; i < num_disks; i++) {
-            if (counts[i] > counts[max_idx]) {
-                max_idx = i;
+
+        if (mode == MAP_PUNCH && *ptr != 0) {
+            free_file_blocks(ptr, 1);
+            *ptr = 0;
+            inode->nblocks--;
+            if (block_index >= DIND_FIRST) {
+                of->leaf_dirty = 1;
+            } else if (block_index >= D_BLOCK) {
+                ind_dirty = 1;
+            }
+        }
+        if (*ptr == 0) {
+            if (holes) {
+                blocks[mapped] = 0;
+                continue;
+            }
+            if (!alloc) break;
+            int block_num = allocate_file_block(of, prev);
+            if (block_num < 0) {
+                *err = block_num;
+                break;
+            }
+            if (mode == MAP_ZERO) {
+                char zero_block[block_size];
+                memset(zero_block, 0, block_size);
+                raid_write(zero_block, block_num, block_size);
+            }
+            *ptr = block_num;
+            inode->nblocks++;
+            if (block_index >= DIND_FIRST) {
+                of->leaf_dirty = 1;
+            } else if (block_index >= D_BLOCK) {
+                ind_dirty = 1;
             }
         }
-        memcpy(buf, temp_buf[max_idx], size);
+        blocks[mapped] = *ptr;
+        prev = *ptr;
     }
-    return size;
-}
 
-ssize_t raid_write(void *buf, off_t block_number, size_t size) {
-    if (raid_mode == 0) {
-        // RAID 0
-        int stripe_index = block_number / num_disks;
-        int disk_idx = block_number % num_disks;
-        off_t disk_offset = superblock.d_blocks_ptr + stripe_index * BLOCK_SIZE;
-        memcpy(disk_maps[disk_idx] + disk_offset, buf, size);
-    } else if (raid_mode == 1 || raid_mode == 2) {
-        // RAID 1 and RAID 1v
-        for (int i = 0; i < num_disks; i++) {
-            memcpy(disk_maps[i] + superblock.d_blocks_ptr + block_number * BLOCK_SIZE, buf, size);
-        }
+    if (ind_dirty) {
+        int res = write_indirect_pointers(inode, of->indirect_pointers);
+        if (res != 0 && *err == 0) *err = res;
     }
-    return size;
+    if (large) {
+        int res = open_file_flush_leaf(of);
+        if (res != 0 && *err == 0) *err = res;
+        pthread_mutex_unlock(&of->leaf_lock);
+    }
+    return mapped;
 }
 
-// Inode operations
-int load_inode(int inode_num, struct wfs_inode *inode) {
-    off_t inode_offset = superblock.i_blocks_ptr + inode_num * INODE_SIZE;
-    memcpy(inode, disk_maps[0] + inode_offset, sizeof(struct wfs_inode));
-    fprintf(stderr, "[DEBUG] load_inode: Loaded inode %d at offset %ld\n", inode_num, inode_offset);
-    return 0;
+// Copies len bytes between buf and the n mapped blocks, starting at byte
+// block_offset of blocks[0]. Reads of block 0, a hole, fill in zeroes.
+void copy_extents(char *buf, const off_t *blocks, int n, size_t block_offset, size_t len, int write) {
+    int i = 0;
+    while (len > 0 && i < n) {
+        int run = 1;
+        if (blocks[i] == 0) {
+            // A hole, which reads as zeroes
+            while (i + run < n && blocks[i + run] == 0) {
+                run++;
+            }
+        } else {
+            while (i + run < n && blocks[i + run] == blocks[i] + run) {
+                run++;
+            }
+        }
+        size_t bytes = (size_t) run * block_size - block_offset;
+        if (bytes > len) {
+            bytes = len;
+        }
+        if (blocks[i] == 0) {
+            memset(buf, 0, bytes);
+        } else if (write) {
+            raid_write_extent(buf, blocks[i], block_offset, bytes);
+        } else {
+            raid_read_extent(buf, blocks[i], block_offset, bytes);
+        }
+        buf += bytes;
+        len -= bytes;
+        block_offset = 0;
+        i += run;
+    }
 }
 
-void print_directory_entries(int dir_inode_num) {
-    struct wfs_inode dir_inode;
-    load_inode(dir_inode_num, &dir_inode);
+// Dentry cache
+//
+// Direct-mapped cache of (parent inode, name) -> child lookups so that path
+// traversal does not rescan directory blocks for every component. A slot with
+// inode_num == -1 is a negative entry recording that the name does not exist.
+#define DCACHE_SLOTS 4096
+
+struct dcache_entry {
+    int valid;
+    int parent;
+    int inode_num;       // -1 for a negative entry
+    mode_t mode;         // Mode of the child, used for the ENOTDIR check
+    char name[MAX_NAME];
+};
 
-    printf("[DEBUG] Directory Entries for inode %d:\n", dir_inode_num);
+static struct dcache_entry dcache[DCACHE_SLOTS];
+static uint64_t dcache_hits = 0;
+static uint64_t dcache_misses = 0;
 
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
-    for (int i = 0; i < N_BLOCKS; i++) {
-        if (dir_inode.blocks[i] == 0) continue;
-        char block_buf[BLOCK_SIZE];
-        raid_read(block_buf, dir_inode.blocks[i], BLOCK_SIZE);
-        struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
+static unsigned int dcache_hash(int parent, const char *name) {
+    // FNV-1a over the parent inode number and the name
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < (int) sizeof(parent); i++) {
+        h = (h ^ ((parent >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    for (const char *c = name; *c; c++) {
+        h = (h ^ (unsigned char) *c) * 16777619u;
+    }
+    return h % DCACHE_SLOTS;
+}
 
-        for (int j = 0; j < entries_per_block; j++) {
-            if (strlen(entries[j].name) == 0) continue;
-            printf("[DEBUG] Entry: Name='%s', Inode=%d\n", entries[j].name, entries[j].num);
+#define DCACHE_MISS 1
+
+// Returns 0 on a positive hit, -ENOENT on a negative hit and DCACHE_MISS
+// when the name is not cached
+int dcache_lookup(int parent, const char *name, int *inode_num, mode_t *mode) {
+    if (strlen(name) >= MAX_NAME) return DCACHE_MISS; // Never stored, see add_dentry
+    int res = DCACHE_MISS;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *e = &dcache[dcache_hash(parent, name)];
+    if (e->valid && e->parent == parent && strcmp(e->name, name) == 0) {
+        dcache_hits++;
+        if (e->inode_num < 0) {
+            res = -ENOENT;
+        } else {
+            if (inode_num) *inode_num = e->inode_num;
+            if (mode) *mode = e->mode;
+            res = 0;
         }
+    } else {
+        dcache_misses++;
     }
+    pthread_mutex_unlock(&dcache_lock);
+    return res;
 }
 
-int store_inode(int inode_num, struct wfs_inode *inode) {
-    off_t inode_offset = superblock.i_blocks_ptr + inode_num * INODE_SIZE;
-    for (int i = 0; i < num_disks; i++) {
-        memcpy(disk_maps[i] + inode_offset, inode, sizeof(struct wfs_inode));
+void dcache_insert(int parent, const char *name, int inode_num, mode_t mode) {
+    if (strlen(name) >= MAX_NAME) return;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *e = &dcache[dcache_hash(parent, name)];
+    e->valid = 1;
+    e->parent = parent;
+    e->inode_num = inode_num;
+    e->mode = mode;
+    strcpy(e->name, name);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_invalidate(int parent, const char *name) {
+    if (strlen(name) >= MAX_NAME) return;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry *e = &dcache[dcache_hash(parent, name)];
+    if (e->valid && e->parent == parent && strcmp(e->name, name) == 0) {
+        e->valid = 0;
     }
-    fprintf(stderr, "[DEBUG] store_inode: Stored inode %d at offset %ld on all disks\n", inode_num, inode_offset);
-    return 0;
+    pthread_mutex_unlock(&dcache_lock);
 }
 
-int allocate_inode(void) {
-    char *inode_bitmap = disk_maps[0] + superblock.i_bitmap_ptr;
-    int total_inodes = superblock.num_inodes;
-    for (int i = 0; i < total_inodes; i++) {
-        if (!get_bit(inode_bitmap, i)) {
-            set_bit(inode_bitmap, i);
-            // Mirror the bitmap to other disks
-            for (int j = 1; j < num_disks; j++) {
-                set_bit(disk_maps[j] + superblock.i_bitmap_ptr, i);
-            }
-            fprintf(stderr, "[DEBUG] allocate_inode: Allocated inode %d\n", i);
-            return i;
+// Drop every entry looked up under a directory (used when it is removed,
+// since its inode number can be reused by a new directory)
+void dcache_invalidate_dir(int parent) {
+    pthread_mutex_lock(&dcache_lock);
+    for (int i = 0; i < DCACHE_SLOTS; i++) {
+        if (dcache[i].valid && dcache[i].parent == parent) {
+            dcache[i].valid = 0;
         }
     }
-    fprintf(stderr, "[ERROR] allocate_inode: No free inodes available\n");
-    return -ENOSPC;
+    pthread_mutex_unlock(&dcache_lock);
 }
 
-void free_inode(int inode_num) {
-    clear_bit(disk_maps[0] + superblock.i_bitmap_ptr, inode_num);
-    for (int i = 1; i < num_disks; i++) {
-        clear_bit(disk_maps[i] + superblock.i_bitmap_ptr, inode_num);
+// Directory index
+//
+// On images with WFS_FEATURE_DIR_INDEX a directory is a two-level B-tree over
+// 32-bit FNV-1a hashes of the names, much like ext3's htree. It starts as a
+// single leaf of dentries in blocks[0]. When that leaf fills up,
+// blocks[IND_BLOCK] becomes an index root holding (lowest hash, block) pairs
+// for the leaves; a full leaf is split at a hash boundary near its middle and
+// the new leaf is added to the index. A full root hands its entries to two
+// index nodes and the tree becomes two levels deep; from then on full index
+// nodes split while the root has room. A lookup reads at most three blocks
+// and a directory holds up to DX_FANOUT * DX_FANOUT leaves. Names with the
+// same hash always share a leaf, so a leaf full of one hash cannot take
+// another name with it. Older images keep the linear format: up to N_BLOCKS
+// dentry blocks, scanned in order. Either kind starts out inline when the
+// image has WFS_FEATURE_INLINE_DATA, holding up to INLINE_DENTRIES entries in
+// its inode, and its first block takes those entries when it outgrows them.
+#define DENTRIES_PER_BLOCK ((int)(block_size / sizeof(struct wfs_dentry)))
+#define INLINE_DENTRIES ((int)(INLINE_MAX / sizeof(struct wfs_dentry)))
+
+static int dir_index_enabled = 0;
+
+// Where a hash lives in an indexed directory: the index entries leading to
+// its leaf, as read on the way down
+struct dx_path {
+    struct dx_node root;
+    int root_pos;
+    off_t node_block;        // Index node below the root, 0 at depth 0
+    struct dx_node node;
+    int node_pos;
+};
+
+struct dx_slot {
+    uint32_t hash;
+    struct wfs_dentry dentry;
+};
+
+static uint32_t dx_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_NAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
     }
-    fprintf(stderr, "[DEBUG] free_inode: Freed inode %d\n", inode_num);
+    return hash;
 }
 
-// Data block operations
-int allocate_data_block(void) {
-    char *data_bitmap = disk_maps[0] + superblock.d_bitmap_ptr;
-    int total_blocks = superblock.num_data_blocks;
-    for (int i = 1; i < total_blocks; i++) { // Start from block 1
-        if (!get_bit(data_bitmap, i)) {
-            set_bit(data_bitmap, i);
-            // Mirror the bitmap to other disks (RAID 1 and RAID 1v)
-            if (raid_mode == 1 || raid_mode == 2) {
-                for (int j = 1; j < num_disks; j++) {
-                    set_bit(disk_maps[j] + superblock.d_bitmap_ptr, i);
-                }
-            }
-            fprintf(stderr, "[DEBUG] allocate_data_block: Allocated data block %d\n", i);
-            
-            // Dump the data bitmap and verify mirroring
-            dump_data_bitmap_comparison();
-            
-            return i;
-        }
-    }
-    fprintf(stderr, "[ERROR] allocate_data_block: No free data blocks available\n");
-    return -ENOSPC;
+// Index of the last entry whose hash is <= hash
+// Index nodes fill the first BLOCK_SIZE bytes of their block whatever the
+// block size; the rest is zero
+static void dx_read_node(struct dx_node *node, off_t block) {
+    char buf[block_size];
+    meta_read_block(buf, block);
+    memcpy(node, buf, sizeof(struct dx_node));
 }
 
-void free_data_block(int block_num) {
-    clear_bit(disk_maps[0] + superblock.d_bitmap_ptr, block_num);
-    if (raid_mode == 1 || raid_mode == 2) {
-        for (int i = 1; i < num_disks; i++) {
-            clear_bit(disk_maps[i] + superblock.d_bitmap_ptr, block_num);
+static void dx_write_node(const struct dx_node *node, off_t block) {
+    char buf[block_size];
+    memset(buf, 0, block_size);
+    memcpy(buf, node, sizeof(struct dx_node));
+    meta_write_block(buf, block);
+}
+
+static int dx_search(const struct dx_node *node, uint32_t hash) {
+    int lo = 0, hi = (int) node->count - 1;
+    if (hi >= (int) DX_FANOUT) {
+        hi = DX_FANOUT - 1;
+    }
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (node->entries[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
     }
-    fprintf(stderr, "[DEBUG] free_data_block: Freed data block %d\n", block_num);
+    return lo;
 }
 
-// Indirect Block Helper Functions
-
-int read_indirect_pointers(struct wfs_inode *inode, off_t *indirect_pointers) {
-    if (inode->blocks[IND_BLOCK] == 0) {
-        return -ENOENT; // Indirect block not allocated
+// Returns the leaf that holds (or would hold) names with this hash, or 0 if
+// the directory has no blocks yet. Fills in path when given.
+static off_t dx_find_leaf(struct wfs_inode *dir, uint32_t hash, struct dx_path *path) {
+    if (dir->blocks[IND_BLOCK] == 0) {
+        return dir->blocks[0];
     }
-
-    char buf[BLOCK_SIZE];
-    ssize_t res = raid_read(buf, inode->blocks[IND_BLOCK], BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
-        fprintf(stderr, "[ERROR] read_indirect_pointers: Failed to read indirect block %ld\n", inode->blocks[IND_BLOCK]);
-        return -EIO; // I/O error
+    struct dx_path local;
+    if (path == NULL) {
+        path = &local;
+    }
+    dx_read_node(&path->root, dir->blocks[IND_BLOCK]);
+    path->root_pos = dx_search(&path->root, hash);
+    path->node_block = 0;
+    off_t next = path->root.entries[path->root_pos].block;
+    if (path->root.depth == 0) {
+        return next;
     }
+    path->node_block = next;
+    dx_read_node(&path->node, next);
+    path->node_pos = dx_search(&path->node, hash);
+    return path->node.entries[path->node_pos].block;
+}
 
-    memcpy(indirect_pointers, buf, BLOCK_SIZE);
-    return 0;
+// Inserts (hash, block) at pos of a node that has room
+static void dx_insert(struct dx_node *node, int pos, uint32_t hash, off_t block) {
+    memmove(&node->entries[pos + 1], &node->entries[pos], (node->count - pos) * sizeof(struct dx_entry));
+    node->entries[pos].hash = hash;
+    node->entries[pos].block = block;
+    node->count++;
 }
 
-int write_indirect_pointers(struct wfs_inode *inode, off_t *indirect_pointers) {
-    if (inode->blocks[IND_BLOCK] == 0) {
-        return -ENOENT; // Indirect block not allocated
-    }
+// Inserts (hash, block) at pos of a full node and deals the DX_FANOUT + 1
+// entries out between lo and hi
+static void dx_split_node(const struct dx_node *full, int pos, uint32_t hash, off_t block,
+                          struct dx_node *lo, struct dx_node *hi) {
+    struct dx_entry all[DX_FANOUT + 1];
+    memcpy(all, full->entries, pos * sizeof(struct dx_entry));
+    all[pos].hash = hash;
+    all[pos].block = block;
+    memcpy(&all[pos + 1], &full->entries[pos], (DX_FANOUT - pos) * sizeof(struct dx_entry));
+
+    int half = (DX_FANOUT + 1) / 2;
+    memset(lo, 0, sizeof(*lo));
+    memset(hi, 0, sizeof(*hi));
+    lo->count = half;
+    memcpy(lo->entries, all, half * sizeof(struct dx_entry));
+    hi->count = DX_FANOUT + 1 - half;
+    memcpy(hi->entries, &all[half], hi->count * sizeof(struct dx_entry));
+}
 
-    char buf[BLOCK_SIZE];
-    memcpy(buf, indirect_pointers, BLOCK_SIZE);
-    ssize_t res = raid_write(buf, inode->blocks[IND_BLOCK], BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
-        fprintf(stderr, "[ERROR] write_indirect_pointers: Failed to write indirect block %ld\n", inode->blocks[IND_BLOCK]);
-        return -EIO; // I/O error
+static int dx_slot_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const struct dx_slot *) a)->hash, hb = ((const struct dx_slot *) b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+static void dx_put(struct wfs_dentry *entries, const struct wfs_dentry *dentry) {
+    for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+        if (entries[i].name[0] == '\0') {
+            entries[i] = *dentry;
+            return;
+        }
     }
+}
 
+// Splits the full leaf leaf_block (contents in entries) to make room for
+// dentry, adding the new leaf to the index and growing the index as needed
+static int dx_split_leaf(struct wfs_inode *dir, struct dx_path *path, off_t leaf_block,
+                         struct wfs_dentry *entries, const struct wfs_dentry *dentry, uint32_t hash) {
+    struct dx_slot sorted[DENTRIES_PER_BLOCK];
+    for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+        sorted[i].hash = dx_hash(entries[i].name);
+        sorted[i].dentry = entries[i];
+    }
+    qsort(sorted, DENTRIES_PER_BLOCK, sizeof(struct dx_slot), dx_slot_cmp);
+
+    // The hash boundary closest to the middle
+    int split = -1;
+    for (int d = 0; d < DENTRIES_PER_BLOCK / 2 && split < 0; d++) {
+        int lo = DENTRIES_PER_BLOCK / 2 - d, hi = DENTRIES_PER_BLOCK / 2 + d;
+        if (lo > 0 && sorted[lo - 1].hash != sorted[lo].hash) {
+            split = lo;
+        } else if (hi < DENTRIES_PER_BLOCK && sorted[hi - 1].hash != sorted[hi].hash) {
+            split = hi;
+        }
+    }
+    if (split < 0) {
+        TRACE(TRACE_ERROR, "dx_split_leaf: Too many names with hash %08x in directory inode %d", hash, dir->num);
+        return -ENOSPC;
+    }
+    uint32_t split_hash = sorted[split].hash;
+
+    // Every block the split needs is allocated before anything changes
+    int indexed = dir->blocks[IND_BLOCK] != 0;
+    int need = 1;
+    if (!indexed) {
+        need++;                                    // The root
+    } else if (path->root.depth == 0 && path->root.count >= DX_FANOUT) {
+        need += 2;                                 // Two index nodes under the root
+    } else if (path->root.depth == 1 && path->node.count >= DX_FANOUT) {
+        if (path->root.count >= DX_FANOUT) {
+            TRACE(TRACE_ERROR, "dx_split_leaf: Directory inode %d is full", dir->num);
+            return -ENOSPC;
+        }
+        need++;                                    // A sibling index node
+    }
+    int new_blocks[3];
+    for (int i = 0; i < need; i++) {
+        new_blocks[i] = allocate_data_block();
+        if (new_blocks[i] < 0) {
+            int res = new_blocks[i];
+            while (i-- > 0) {
+                free_data_block(new_blocks[i]);
+            }
+            return res;
+        }
+    }
+    off_t new_leaf = new_blocks[0];
+
+    // Lower hashes stay, the rest move to the new leaf
+    struct wfs_dentry low[DENTRIES_PER_BLOCK], high[DENTRIES_PER_BLOCK];
+    memset(low, 0, sizeof(low));
+    memset(high, 0, sizeof(high));
+    for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+        if (i < split) {
+            low[i] = sorted[i].dentry;
+        } else {
+            high[i - split] = sorted[i].dentry;
+        }
+    }
+    dx_put(hash < split_hash ? low : high, dentry);
+    meta_write_block(low, leaf_block);
+    meta_write_block(high, new_leaf);
+
+    if (!indexed) {
+        struct dx_node root;
+        memset(&root, 0, sizeof(root));
+        root.count = 2;
+        root.entries[0].block = leaf_block;
+        root.entries[1].hash = split_hash;
+        root.entries[1].block = new_leaf;
+        dir->blocks[IND_BLOCK] = new_blocks[1];
+        dx_write_node(&root, dir->blocks[IND_BLOCK]);
+    } else if (path->root.depth == 0 && path->root.count < DX_FANOUT) {
+        dx_insert(&path->root, path->root_pos + 1, split_hash, new_leaf);
+        dx_write_node(&path->root, dir->blocks[IND_BLOCK]);
+    } else if (path->root.depth == 0) {
+        // The root's entries move into two index nodes
+        struct dx_node lo, hi;
+        dx_split_node(&path->root, path->root_pos + 1, split_hash, new_leaf, &lo, &hi);
+        dx_write_node(&lo, new_blocks[1]);
+        dx_write_node(&hi, new_blocks[2]);
+        memset(&path->root, 0, sizeof(path->root));
+        path->root.count = 2;
+        path->root.depth = 1;
+        path->root.entries[0].hash = lo.entries[0].hash;
+        path->root.entries[0].block = new_blocks[1];
+        path->root.entries[1].hash = hi.entries[0].hash;
+        path->root.entries[1].block = new_blocks[2];
+        dx_write_node(&path->root, dir->blocks[IND_BLOCK]);
+    } else if (path->node.count < DX_FANOUT) {
+        dx_insert(&path->node, path->node_pos + 1, split_hash, new_leaf);
+        dx_write_node(&path->node, path->node_block);
+    } else {
+        // The index node splits and its new sibling goes into the root
+        struct dx_node lo, hi;
+        dx_split_node(&path->node, path->node_pos + 1, split_hash, new_leaf, &lo, &hi);
+        dx_write_node(&lo, path->node_block);
+        dx_write_node(&hi, new_blocks[1]);
+        dx_insert(&path->root, path->root_pos + 1, hi.entries[0].hash, new_blocks[1]);
+        dx_write_node(&path->root, dir->blocks[IND_BLOCK]);
+    }
+    TRACE(TRACE_DEBUG, "dx_split_leaf: Split leaf %ld of directory inode %d at hash %08x into block %ld",
+            leaf_block, dir->num, split_hash, new_leaf);
     return 0;
 }
 
-int allocate_indirect_block(struct wfs_inode *inode) {
-    if (inode->blocks[IND_BLOCK] != 0) {
-        // Indirect block already allocated
+// Adds a dentry to an indexed directory
+static int dx_add_dentry(struct wfs_inode *dir, const struct wfs_dentry *dentry) {
+    uint32_t hash = dx_hash(dentry->name);
+    struct dx_path path;
+    off_t leaf = dx_find_leaf(dir, hash, &path);
+    struct wfs_dentry entries[DENTRIES_PER_BLOCK];
+
+    if (leaf == 0) {
+        int block_num = allocate_data_block();
+        if (block_num < 0) {
+            return block_num;
+        }
+        memset(entries, 0, sizeof(entries));
+        entries[0] = *dentry;
+        dir->blocks[0] = block_num;
+        meta_write_block(entries, block_num);
         return 0;
     }
 
-    int block_num = allocate_data_block();
-    if (block_num < 0) {
-        return block_num; // Propagate error
+    meta_read_block(entries, leaf);
+    for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+        if (entries[i].name[0] == '\0') {
+            entries[i] = *dentry;
+            meta_write_block(entries, leaf);
+            return 0;
+        }
     }
+    return dx_split_leaf(dir, &path, leaf, entries, dentry, hash);
+}
 
-    inode->blocks[IND_BLOCK] = block_num;
+// Live entries a leaf may have after absorbing its neighbour, so that a
+// freshly split pair does not merge straight back
+#define DX_MERGE_MAX (DENTRIES_PER_BLOCK * 3 / 4)
 
-    // Initialize the indirect block with zeros
-    char zero_block[BLOCK_SIZE];
-    memset(zero_block, 0, BLOCK_SIZE);
-    ssize_t res = raid_write(zero_block, block_num, BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
-        fprintf(stderr, "[ERROR] allocate_indirect_block: Failed to initialize indirect block %d\n", block_num);
-        free_data_block(block_num); // Free allocated block on failure
-        inode->blocks[IND_BLOCK] = 0;
-        return -EIO; // I/O error
+static int dx_live(const struct wfs_dentry *entries) {
+    int n = 0;
+    for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+        if (entries[i].name[0] != '\0') n++;
     }
-
-    // Persist the updated inode
-    store_inode(inode->num, inode);
-    fprintf(stderr, "[DEBUG] allocate_indirect_block: Allocated indirect block %d for inode %d\n", block_num, inode->num);
-
-    return 0;
+    return n;
 }
 
-int allocate_indirect_data_block(struct wfs_inode *inode, int indirect_index) {
-    if (indirect_index >= INDIRECT_BLOCK_ENTRIES) {
-        fprintf(stderr, "[ERROR] allocate_indirect_data_block: Indirect index %d out of range\n", indirect_index);
-        return -EFBIG; // File too large
+// Called after a removal from leaf (contents in entries). An empty leaf is
+// dropped from its index node, and a sparse one is merged with a neighbour
+// in the same node when the two fit in DX_MERGE_MAX entries; the left block
+// survives, so blocks[0] always stays the first leaf. An index that is down
+// to a single leaf is removed.
+static void dx_shrink(struct wfs_inode *dir, struct dx_path *path, off_t leaf, struct wfs_dentry *entries) {
+    if (dir->blocks[IND_BLOCK] == 0) {
+        return;
     }
-
-    off_t indirect_pointers[INDIRECT_BLOCK_ENTRIES];
-    int res = read_indirect_pointers(inode, indirect_pointers);
-    if (res != 0) {
-        return res; // Propagate error
+    struct dx_node *parent = path->root.depth == 0 ? &path->root : &path->node;
+    off_t parent_block = path->root.depth == 0 ? dir->blocks[IND_BLOCK] : path->node_block;
+    int pos = path->root.depth == 0 ? path->root_pos : path->node_pos;
+    if (parent->count < 2) {
+        return;
     }
 
-    if (indirect_pointers[indirect_index] != 0) {
-        // Data block already allocated
-        return indirect_pointers[indirect_index];
+    int live = dx_live(entries);
+    int drop = -1;
+    if (live == 0 && leaf != dir->blocks[0]) {
+        drop = pos;
+        free_meta_block(leaf);
+    } else {
+        // Merge with the left neighbour if there is one, else the right
+        int left = pos > 0 ? pos - 1 : pos;
+        int right = left + 1;
+        if (right >= (int) parent->count) {
+            return;
+        }
+        struct wfs_dentry other[DENTRIES_PER_BLOCK];
+        off_t other_block = parent->entries[left == pos ? right : left].block;
+        meta_read_block(other, other_block);
+        if (live + dx_live(other) > DX_MERGE_MAX) {
+            return;
+        }
+        struct wfs_dentry *into = left == pos ? entries : other;
+        struct wfs_dentry *from = left == pos ? other : entries;
+        for (int i = 0; i < DENTRIES_PER_BLOCK; i++) {
+            if (from[i].name[0] != '\0') {
+                dx_put(into, &from[i]);
+            }
+        }
+        meta_write_block(into, parent->entries[left].block);
+        free_meta_block(parent->entries[right].block);
+        drop = right;
     }
-
-    // Allocate a new data block
-    int block_num = allocate_data_block();
-    if (block_num < 0) {
-        return block_num; // Propagate error
+    memmove(&parent->entries[drop], &parent->entries[drop + 1], (parent->count - drop - 1) * sizeof(struct dx_entry));
+    parent->count--;
+    memset(&parent->entries[parent->count], 0, sizeof(struct dx_entry));
+
+    if (path->root.depth == 0 && path->root.count == 1) {
+        // Back to a single leaf, which is blocks[0]
+        free_meta_block(dir->blocks[IND_BLOCK]);
+        dir->blocks[IND_BLOCK] = 0;
+        return;
     }
+    dx_write_node(parent, parent_block);
+}
 
-    // Set the pointer in the indirect block
-    indirect_pointers[indirect_index] = block_num;
-
-    // Write back the updated indirect block
-    res = write_indirect_pointers(inode, indirect_pointers);
-    if (res != 0) {
-        free_data_block(block_num); // Free allocated block on failure
-        indirect_pointers[indirect_index] = 0;
-        return res;
+// Calls fn with every dentry block of a directory, in index order for
+// indexed directories, until fn returns nonzero; returns that value
+int dir_for_each_block(struct wfs_inode *dir, int (*fn)(off_t block, struct wfs_dentry *entries, void *arg), void *arg) {
+    struct wfs_dentry entries[DENTRIES_PER_BLOCK];
+    if (inode_is_inline(dir)) {
+        // Handed over as a block whose trailing entries are empty
+        memset(entries, 0, sizeof(entries));
+        inline_read(dir->num, entries, 0, INLINE_DENTRIES * sizeof(struct wfs_dentry));
+        return fn(0, entries, arg);
+    }
+    if (!dir_index_enabled || dir->blocks[IND_BLOCK] == 0) {
+        int nblocks = dir_index_enabled ? 1 : N_BLOCKS;
+        for (int i = 0; i < nblocks; i++) {
+            if (dir->blocks[i] == 0) continue;
+            meta_read_block(entries, dir->blocks[i]);
+            int res = fn(dir->blocks[i], entries, arg);
+            if (res != 0) return res;
+        }
+        return 0;
     }
 
-    fprintf(stderr, "[DEBUG] allocate_indirect_data_block: Allocated indirect data block %d for inode %d at indirect index %d\n",
-            block_num, inode->num, indirect_index);
-
-    return block_num;
+    struct dx_node root, node;
+    dx_read_node(&root, dir->blocks[IND_BLOCK]);
+    for (uint32_t i = 0; i < root.count && i < DX_FANOUT; i++) {
+        int nleaves = 1;
+        struct dx_entry *leaves = &root.entries[i];
+        if (root.depth == 1) {
+            dx_read_node(&node, root.entries[i].block);
+            nleaves = node.count < DX_FANOUT ? node.count : DX_FANOUT;
+            leaves = node.entries;
+        }
+        for (int j = 0; j < nleaves; j++) {
+            meta_read_block(entries, leaves[j].block);
+            int res = fn(leaves[j].block, entries, arg);
+            if (res != 0) return res;
+        }
+    }
+    return 0;
 }
 
-int free_indirect_blocks(struct wfs_inode *inode) {
-    if (inode->blocks[IND_BLOCK] == 0) {
-        return 0; // No indirect block to free
+// Frees every block of a directory that is being removed
+void dir_free_blocks(struct wfs_inode *dir) {
+    if (dir_index_enabled && dir->blocks[IND_BLOCK] != 0) {
+        struct dx_node root, node;
+        dx_read_node(&root, dir->blocks[IND_BLOCK]);
+        for (uint32_t i = 0; i < root.count && i < DX_FANOUT; i++) {
+            if (root.depth == 1) {
+                dx_read_node(&node, root.entries[i].block);
+                for (uint32_t j = 0; j < node.count && j < DX_FANOUT; j++) {
+                    free_meta_block(node.entries[j].block);
+                }
+            }
+            free_meta_block(root.entries[i].block);
+        }
+        // blocks[0] was the first leaf
+        free_meta_block(dir->blocks[IND_BLOCK]);
+        memset(dir->blocks, 0, sizeof(dir->blocks));
+        return;
     }
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (dir->blocks[i] != 0) {
+            free_meta_block(dir->blocks[i]);
+            dir->blocks[i] = 0;
+        }
+    }
+}
 
-    off_t indirect_pointers[INDIRECT_BLOCK_ENTRIES];
-    int res = read_indirect_pointers(inode, indirect_pointers);
-    if (res != 0) {
-        return res; // Propagate error
+// Linear directory slots
+//
+// In the linear format an entry's slot is its index in the directory's
+// blocks, and the size covers every slot up to the last one used. Removing an
+// entry leaves a hole; add_dentry fills the first hole at or after the
+// directory's free-slot hint before appending. The hint (one per inode, kept
+// in memory and guarded by the directory's inode lock) only moves down when
+// an entry is removed, so no hole is ever below it. Once a block's worth of
+// slots is dead, dir_compact rewrites the live entries densely and frees the
+// blocks that are left over. The root's first two slots stand for '.' and
+// '..' and are kept.
+
+// Returns the first free slot in [from, slots), or slots if there is none
+static int dir_find_hole(struct wfs_inode *dir, int from, int slots) {
+    struct wfs_dentry entries[DENTRIES_PER_BLOCK];
+    for (int slot = from; slot < slots; ) {
+        int i = slot / DENTRIES_PER_BLOCK;
+        if (dir->blocks[i] == 0) {
+            slot = (i + 1) * DENTRIES_PER_BLOCK;
+            continue;
+        }
+        meta_read_block(entries, dir->blocks[i]);
+        for (; slot < slots && slot / DENTRIES_PER_BLOCK == i; slot++) {
+            if (entries[slot % DENTRIES_PER_BLOCK].name[0] == '\0') {
+                return slot;
+            }
+        }
     }
+    return slots;
+}
 
-    // Free each data block referenced by the indirect block
-    for (int i = 0; i < INDIRECT_BLOCK_ENTRIES; i++) {
-        if (indirect_pointers[i] != 0) {
-            free_data_block(indirect_pointers[i]);
-            indirect_pointers[i] = 0;
+// Compacts a linear directory once a block's worth of its slots is dead,
+// and otherwise trims dead slots off the end. Caller stores the inode.
+static void dir_compact(struct wfs_inode *dir) {
+    struct wfs_dentry live[N_BLOCKS * DENTRIES_PER_BLOCK];
+    struct wfs_dentry entries[DENTRIES_PER_BLOCK];
+    int slots = dir->size / sizeof(struct wfs_dentry);
+    int keep = dir->num == 0 ? 2 : 0;
+    int n = 0, end = keep;
+    memset(live, 0, sizeof(live));
+    for (int i = 0; i < N_BLOCKS && i * DENTRIES_PER_BLOCK < slots; i++) {
+        if (dir->blocks[i] == 0) continue;
+        meta_read_block(entries, dir->blocks[i]);
+        for (int j = 0; j < DENTRIES_PER_BLOCK && i * DENTRIES_PER_BLOCK + j < slots; j++) {
+            if (entries[j].name[0] != '\0') {
+                live[keep + n++] = entries[j];
+                end = i * DENTRIES_PER_BLOCK + j + 1;
+            }
         }
     }
 
-    // Write back the zeroed indirect block
-    char zero_block[BLOCK_SIZE];
-    memset(zero_block, 0, BLOCK_SIZE);
-    res = raid_write(zero_block, inode->blocks[IND_BLOCK], BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
-        fprintf(stderr, "[ERROR] free_indirect_blocks: Failed to zero indirect block %ld\n", inode->blocks[IND_BLOCK]);
-        return -EIO; // I/O error
+    int new_slots = end;
+    if (slots - keep - n >= DENTRIES_PER_BLOCK) {
+        new_slots = keep + n;
+        for (int i = 0; i * DENTRIES_PER_BLOCK < new_slots; i++) {
+            meta_write_block(&live[i * DENTRIES_PER_BLOCK], dir->blocks[i]);
+        }
+        dir_free_hint[dir->num] = new_slots;
+        TRACE(TRACE_DEBUG, "dir_compact: Compacted directory inode %d from %d to %d slots", dir->num, slots, new_slots);
+    } else if (end == slots) {
+        return;
     }
+    for (int i = (new_slots + DENTRIES_PER_BLOCK - 1) / DENTRIES_PER_BLOCK; i < N_BLOCKS; i++) {
+        if (dir->blocks[i] != 0) {
+            free_meta_block(dir->blocks[i]);
+            dir->blocks[i] = 0;
+        }
+    }
+    dir->size = new_slots * sizeof(struct wfs_dentry);
+    if (dir_free_hint[dir->num] > new_slots) {
+        dir_free_hint[dir->num] = new_slots;
+    }
+}
 
-    // Free the indirect block itself
-    free_data_block(inode->blocks[IND_BLOCK]);
-    fprintf(stderr, "[DEBUG] free_indirect_blocks: Freed indirect block %ld for inode %d\n", inode->blocks[IND_BLOCK], inode->num);
-    inode->blocks[IND_BLOCK] = 0;
+// Moves an inline directory's entries into a new first dentry block, packed
+// from slot 0, which is a leaf on indexed images. Caller holds the
+// directory's write lock and stores the inode.
+static int inline_dir_to_blocks(struct wfs_inode *dir) {
+    struct wfs_dentry inline_entries[INLINE_DENTRIES];
+    char block_buf[block_size];
+    struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
+    int n = 0;
 
-    // Persist the updated inode
-    store_inode(inode->num, inode);
+    inline_read(dir->num, inline_entries, 0, sizeof(inline_entries));
+    memset(block_buf, 0, block_size);
+    for (int j = 0; j < INLINE_DENTRIES; j++) {
+        if (inline_entries[j].name[0] != '\0') {
+            entries[n++] = inline_entries[j];
+        }
+    }
 
+    int block_num = allocate_data_block();
+    if (block_num < 0) {
+        return block_num;
+    }
+    meta_write_block(block_buf, block_num);
+    dir->blocks[0] = block_num;
+    dir->size = n * sizeof(struct wfs_dentry);
+    dir->flags &= ~WFS_INODE_INLINE;
+    dir_free_hint[dir->num] = n;
+    inline_write(dir->num, NULL, 0, INLINE_MAX);
+    TRACE(TRACE_DEBUG, "inline_dir_to_blocks: Moved %d entries of directory inode %d to block %d", n, dir->num, block_num);
     return 0;
 }
 
 // Directory operations
 int find_dentry(struct wfs_inode *dir_inode, const char *name, struct wfs_dentry *dentry) {
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
+
+    if (inode_is_inline(dir_inode)) {
+        struct wfs_dentry entries[INLINE_DENTRIES];
+        inline_read(dir_inode->num, entries, 0, sizeof(entries));
+        for (int j = 0; j < INLINE_DENTRIES; j++) {
+            if (entries[j].name[0] != '\0' && strcmp(entries[j].name, name) == 0) {
+                if (dentry != NULL) {
+                    *dentry = entries[j];
+                }
+                TRACE(TRACE_DEBUG, "find_dentry: Found dentry '%s' (inode %d) in inline directory inode %d", name, entries[j].num, dir_inode->num);
+                return 0;
+            }
+        }
+        TRACE(TRACE_DEBUG, "find_dentry: '%s' not found in directory inode %d", name, dir_inode->num);
+        return -ENOENT;
+    }
 
+    // An indexed directory only has one leaf to look in
+    off_t leaf = dir_index_enabled ? dx_find_leaf(dir_inode, dx_hash(name), NULL) : 0;
     for (int i = 0; i < N_BLOCKS; i++) {
-        if (dir_inode->blocks[i] == 0) continue;
-        char block_buf[BLOCK_SIZE];
-        raid_read(block_buf, dir_inode->blocks[i], BLOCK_SIZE);
+        off_t block = dir_index_enabled ? (i == 0 ? leaf : 0) : dir_inode->blocks[i];
+        if (block == 0) continue;
+        char block_buf[block_size];
+        meta_read_block(block_buf, block);
         struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
 
         for (int j = 0; j < entries_per_block; j++) {
@@ -383,13 +3362,13 @@ int find_dentry(struct wfs_inode *dir_inode, const char *name, struct wfs_dentry
                 if (dentry != NULL) {
                     *dentry = entries[j];
                 }
-                fprintf(stderr, "[DEBUG] find_dentry: Found dentry '%s' (inode %d) in directory inode %d\n", name, entries[j].num, dir_inode->num);
+                TRACE(TRACE_DEBUG, "find_dentry: Found dentry '%s' (inode %d) in directory inode %d", name, entries[j].num, dir_inode->num);
                 return 0; // Found
             }
         }
     }
     // If not found, log the error
-    fprintf(stderr, "[ERROR] find_dentry: '%s' not found in directory inode %d\n", name, dir_inode->num);
+    TRACE(TRACE_DEBUG, "find_dentry: '%s' not found in directory inode %d", name, dir_inode->num);
     return -ENOENT; // Not found
 }
 
@@ -400,133 +3379,291 @@ int add_dentry(struct wfs_inode *dir_inode, const char *name, int inode_num) {
     new_entry.name[MAX_NAME - 1] = '\0';
     new_entry.num = inode_num;
 
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    if (inode_is_inline(dir_inode)) {
+        struct wfs_dentry entries[INLINE_DENTRIES];
+        inline_read(dir_inode->num, entries, 0, sizeof(entries));
+        for (int j = 0; j < INLINE_DENTRIES; j++) {
+            if (entries[j].name[0] != '\0') continue;
+            inline_write(dir_inode->num, &new_entry, j * sizeof(struct wfs_dentry), sizeof(new_entry));
+            dir_inode->size += sizeof(struct wfs_dentry);
+            store_inode(dir_inode->num, dir_inode);
+            dcache_invalidate(dir_inode->num, new_entry.name);
+            TRACE(TRACE_DEBUG, "add_dentry: Added dentry '%s' (inode %d) to inline directory inode %d", name, inode_num, dir_inode->num);
+            return 0;
+        }
+        // Every inline slot is taken; the entry goes in the new block
+        int res = inline_dir_to_blocks(dir_inode);
+        if (res != 0) {
+            TRACE(TRACE_ERROR, "add_dentry: No space to add '%s' in directory inode %d", name, dir_inode->num);
+            return res;
+        }
+    }
+
+    if (dir_index_enabled) {
+        int res = dx_add_dentry(dir_inode, &new_entry);
+        if (res != 0) {
+            TRACE(TRACE_ERROR, "add_dentry: No space to add '%s' in directory inode %d", name, dir_inode->num);
+            return res;
+        }
+        dir_inode->size += sizeof(struct wfs_dentry);
+        store_inode(dir_inode->num, dir_inode);
+        dcache_invalidate(dir_inode->num, new_entry.name);
+        TRACE(TRACE_DEBUG, "add_dentry: Added dentry '%s' (inode %d) to indexed directory inode %d", name, inode_num, dir_inode->num);
+        return 0;
+    }
+
+    // Fill a hole if there is one, otherwise append
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
     int total_entries = dir_inode->size / sizeof(struct wfs_dentry);
-    int block_idx = total_entries / entries_per_block;
-    int entry_idx = total_entries % entries_per_block;
+    int slot = dir_find_hole(dir_inode, dir_free_hint[dir_inode->num], total_entries);
+    int block_idx = slot / entries_per_block;
+    int entry_idx = slot % entries_per_block;
 
-    fprintf(stderr, "[DEBUG] add_dentry: total_entries=%d, block_idx=%d, entry_idx=%d\n", total_entries, block_idx, entry_idx);
+    TRACE(TRACE_DEBUG, "add_dentry: total_entries=%d, block_idx=%d, entry_idx=%d", total_entries, block_idx, entry_idx);
 
     if (block_idx >= N_BLOCKS) {
-        fprintf(stderr, "[ERROR] add_dentry: No space to add '%s' in directory inode %d\n", name, dir_inode->num);
+        TRACE(TRACE_ERROR, "add_dentry: No space to add '%s' in directory inode %d", name, dir_inode->num);
         return -ENOSPC;
     }
 
+    char block_buf[block_size];
     if (dir_inode->blocks[block_idx] == 0) { // Check if block is allocated
         int block_num = allocate_data_block();
         if (block_num < 0) {
-            fprintf(stderr, "[ERROR] add_dentry: Failed to allocate data block for '%s'\n", name);
+            TRACE(TRACE_ERROR, "add_dentry: Failed to allocate data block for '%s'", name);
             return block_num;
         }
         dir_inode->blocks[block_idx] = block_num;
-        fprintf(stderr, "[DEBUG] add_dentry: Allocated block %d for directory inode %d\n", block_num, dir_inode->num);
+        TRACE(TRACE_DEBUG, "add_dentry: Allocated block %d for directory inode %d", block_num, dir_inode->num);
+        // A reused block still holds old data; start from empty entries
+        memset(block_buf, 0, block_size);
+    } else {
+        meta_read_block(block_buf, dir_inode->blocks[block_idx]);
     }
-
-    char block_buf[BLOCK_SIZE];
-    raid_read(block_buf, dir_inode->blocks[block_idx], BLOCK_SIZE);
     struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
 
     entries[entry_idx] = new_entry;
-    raid_write(block_buf, dir_inode->blocks[block_idx], BLOCK_SIZE);
-    fprintf(stderr, "[DEBUG] add_dentry: Wrote dentry '%s' to block_idx=%d, entry_idx=%d\n", name, block_idx, entry_idx);
+    meta_write_block(block_buf, dir_inode->blocks[block_idx]);
+    TRACE(TRACE_DEBUG, "add_dentry: Wrote dentry '%s' to block_idx=%d, entry_idx=%d", name, block_idx, entry_idx);
 
-    // Increment size by the size of one directory entry
-    dir_inode->size += sizeof(struct wfs_dentry);
-    fprintf(stderr, "[DEBUG] add_dentry: Updated directory inode %d size to %ld\n", dir_inode->num, dir_inode->size);
+    // An appended entry grows the directory by one slot
+    if (slot == total_entries) {
+        dir_inode->size += sizeof(struct wfs_dentry);
+    }
+    dir_free_hint[dir_inode->num] = slot + 1;
+    TRACE(TRACE_DEBUG, "add_dentry: Updated directory inode %d size to %ld", dir_inode->num, dir_inode->size);
 
     // Persist parent's updated inode (with possibly new block and updated size)
     store_inode(dir_inode->num, dir_inode);
-    fprintf(stderr, "[DEBUG] add_dentry: Added dentry '%s' (inode %d) to directory inode %d\n", name, inode_num, dir_inode->num);
+    dcache_invalidate(dir_inode->num, new_entry.name);
+    TRACE(TRACE_DEBUG, "add_dentry: Added dentry '%s' (inode %d) to directory inode %d", name, inode_num, dir_inode->num);
+    return 0;
+}
+
+// Points an existing entry at another inode, rewriting only the slot that
+// holds it. The directory's size and blocks do not change.
+int replace_dentry(struct wfs_inode *dir_inode, const char *name, int inode_num) {
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
+
+    if (inode_is_inline(dir_inode)) {
+        struct wfs_dentry entries[INLINE_DENTRIES];
+        inline_read(dir_inode->num, entries, 0, sizeof(entries));
+        for (int j = 0; j < INLINE_DENTRIES; j++) {
+            if (entries[j].name[0] != '\0' && strcmp(entries[j].name, name) == 0) {
+                entries[j].num = inode_num;
+                inline_write(dir_inode->num, &entries[j], j * sizeof(struct wfs_dentry), sizeof(struct wfs_dentry));
+                dcache_invalidate(dir_inode->num, name);
+                return 0;
+            }
+        }
+        return -ENOENT;
+    }
 
-    // Print directory entries for verification
-    print_directory_entries(dir_inode->num);
+    off_t leaf = dir_index_enabled ? dx_find_leaf(dir_inode, dx_hash(name), NULL) : 0;
+    for (int i = 0; i < N_BLOCKS; i++) {
+        off_t block = dir_index_enabled ? (i == 0 ? leaf : 0) : dir_inode->blocks[i];
+        if (block == 0) continue;
+        char block_buf[block_size];
+        meta_read_block(block_buf, block);
+        struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
 
-    return 0;
+        for (int j = 0; j < entries_per_block; j++) {
+            if (entries[j].name[0] != '\0' && strcmp(entries[j].name, name) == 0) {
+                entries[j].num = inode_num;
+                meta_write_block(block_buf, block);
+                dcache_invalidate(dir_inode->num, name);
+                TRACE(TRACE_DEBUG, "replace_dentry: '%s' in directory inode %d now refers to inode %d", name, dir_inode->num, inode_num);
+                return 0;
+            }
+        }
+    }
+    TRACE(TRACE_ERROR, "replace_dentry: '%s' not found in directory inode %d", name, dir_inode->num);
+    return -ENOENT;
 }
 
 int remove_dentry(struct wfs_inode *dir_inode, const char *name) {
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
+
+    if (inode_is_inline(dir_inode)) {
+        struct wfs_dentry entries[INLINE_DENTRIES];
+        inline_read(dir_inode->num, entries, 0, sizeof(entries));
+        for (int j = 0; j < INLINE_DENTRIES; j++) {
+            if (entries[j].name[0] != '\0' && strcmp(entries[j].name, name) == 0) {
+                // Inline directories count live entries. The caller stores
+                // the inode.
+                inline_write(dir_inode->num, NULL, j * sizeof(struct wfs_dentry), sizeof(struct wfs_dentry));
+                dir_inode->size -= sizeof(struct wfs_dentry);
+                dcache_invalidate(dir_inode->num, name);
+                TRACE(TRACE_DEBUG, "remove_dentry: Removed dentry '%s' from inline directory inode %d", name, dir_inode->num);
+                return 0;
+            }
+        }
+        TRACE(TRACE_ERROR, "remove_dentry: '%s' not found in directory inode %d", name, dir_inode->num);
+        return -ENOENT;
+    }
 
+    struct dx_path path;
+    off_t leaf = dir_index_enabled ? dx_find_leaf(dir_inode, dx_hash(name), &path) : 0;
     for (int i = 0; i < N_BLOCKS; i++) {
-        if (dir_inode->blocks[i] == 0) continue;
-        char block_buf[BLOCK_SIZE];
-        raid_read(block_buf, dir_inode->blocks[i], BLOCK_SIZE);
+        off_t block = dir_index_enabled ? (i == 0 ? leaf : 0) : dir_inode->blocks[i];
+        if (block == 0) continue;
+        char block_buf[block_size];
+        meta_read_block(block_buf, block);
         struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
 
         for (int j = 0; j < entries_per_block; j++) {
             if (strlen(entries[j].name) == 0) continue;
             if (strcmp(entries[j].name, name) == 0) {
-                // Remove the entry
+                // Remove the entry, then give back space the directory no
+                // longer needs. The caller stores the inode.
                 memset(&entries[j], 0, sizeof(struct wfs_dentry));
-                raid_write(block_buf, dir_inode->blocks[i], BLOCK_SIZE);
-                fprintf(stderr, "[DEBUG] remove_dentry: Removed dentry '%s' from directory inode %d\n", name, dir_inode->num);
+                meta_write_block(block_buf, block);
+                if (dir_index_enabled) {
+                    // Indexed directories count live entries
+                    dir_inode->size -= sizeof(struct wfs_dentry);
+                    dx_shrink(dir_inode, &path, block, entries);
+                } else {
+                    int slot = i * entries_per_block + j;
+                    if (dir_free_hint[dir_inode->num] > slot) {
+                        dir_free_hint[dir_inode->num] = slot;
+                    }
+                    dir_compact(dir_inode);
+                }
+                dcache_invalidate(dir_inode->num, name);
+                TRACE(TRACE_DEBUG, "remove_dentry: Removed dentry '%s' from directory inode %d", name, dir_inode->num);
                 return 0;
             }
         }
     }
     // If not found, log the error
-    fprintf(stderr, "[ERROR] remove_dentry: '%s' not found in directory inode %d\n", name, dir_inode->num);
+    TRACE(TRACE_ERROR, "remove_dentry: '%s' not found in directory inode %d", name, dir_inode->num);
     return -ENOENT;
 }
 
-// Path traversal
-int traverse_path(const char *path, struct wfs_inode *inode, int *inode_num) {
-    if (strcmp(path, "/") == 0) {
-        load_inode(0, inode);
-        if (inode_num) *inode_num = 0;
-        return 0;
+// Scans the directory for a name after a dentry cache miss and caches the
+// result. Caller holds the directory's inode lock, so no entry can be added or
+// removed between the scan and the cache insert.
+static int scan_dentry(int dir_inode_num, const char *name, int *inode_num, mode_t *mode) {
+    struct wfs_inode dir_inode;
+    load_inode(dir_inode_num, &dir_inode);
+    struct wfs_dentry dentry;
+    if (find_dentry(&dir_inode, name, &dentry) != 0) {
+        dcache_insert(dir_inode_num, name, -1, 0);
+        return -ENOENT;
     }
 
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        fprintf(stderr, "[ERROR] traverse_path: strdup failed for path '%s'\n", path);
-        return -ENOMEM;
+    // Only the type bits are used and those never change, so the child's
+    // lock is not needed
+    struct wfs_inode child_inode;
+    load_inode(dentry.num, &child_inode);
+    dcache_insert(dir_inode_num, name, dentry.num, child_inode.mode);
+    if (inode_num) *inode_num = dentry.num;
+    if (mode) *mode = child_inode.mode;
+    return 0;
+}
+
+// Looks up a name in a directory, going to the directory blocks only on a
+// dentry cache miss. Fills in the child's inode number and mode on success.
+int lookup_dentry(int dir_inode_num, const char *name, int *inode_num, mode_t *mode) {
+    int res = dcache_lookup(dir_inode_num, name, inode_num, mode);
+    if (res != DCACHE_MISS) {
+        return res;
+    }
+    inode_rdlock(dir_inode_num);
+    res = scan_dentry(dir_inode_num, name, inode_num, mode);
+    inode_unlock(dir_inode_num);
+    return res;
+}
+
+// Same as lookup_dentry for callers already holding the directory's lock
+int lookup_dentry_locked(int dir_inode_num, const char *name, int *inode_num, mode_t *mode) {
+    int res = dcache_lookup(dir_inode_num, name, inode_num, mode);
+    if (res != DCACHE_MISS) {
+        return res;
     }
+    return scan_dentry(dir_inode_num, name, inode_num, mode);
+}
 
-    char *rest = path_copy;
-    char *token;
-
+// Path traversal
+int traverse_path(const char *path, struct wfs_inode *inode, int *inode_num) {
     // Start from root inode
-    struct wfs_inode current_inode;
     int current_inode_num = 0;
-    load_inode(current_inode_num, &current_inode);
+    mode_t current_mode = S_IFDIR;
 
-    while ((token = strsep(&rest, "/")) != NULL) {
-        if (strlen(token) == 0) continue;
+    const char *p = path;
+    while (*p != '\0') {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        size_t len = strcspn(p, "/");
 
-        if ((current_inode.mode & S_IFDIR) == 0) {
-            fprintf(stderr, "[ERROR] traverse_path: '%s' is not a directory in path '%s'\n", token, path);
-            free(path_copy);
+        if ((current_mode & S_IFDIR) == 0) {
+            TRACE(TRACE_DEBUG, "traverse_path: component before '%.*s' is not a directory in path '%s'", (int) len, p, path);
             return -ENOTDIR;
         }
-        struct wfs_dentry dentry;
-        int res = find_dentry(&current_inode, token, &dentry);
-        if (res != 0) {
-            fprintf(stderr, "[ERROR] traverse_path: '%s' not found in path '%s'\n", token, path);
-            free(path_copy);
+        if (len >= MAX_NAME) {
+            // Names are truncated to MAX_NAME - 1 when stored, so this cannot match
+            TRACE(TRACE_DEBUG, "traverse_path: '%.*s' not found in path '%s'", (int) len, p, path);
             return -ENOENT;
         }
-        current_inode_num = dentry.num;
-        load_inode(current_inode_num, &current_inode);
+        char token[MAX_NAME];
+        memcpy(token, p, len);
+        token[len] = '\0';
+        p += len;
+
+        int res = lookup_dentry(current_inode_num, token, &current_inode_num, &current_mode);
+        if (res != 0) {
+            TRACE(TRACE_DEBUG, "traverse_path: '%s' not found in path '%s'", token, path);
+            return res;
+        }
     }
 
-    if (inode) *inode = current_inode;
+    if (inode) {
+        inode_rdlock(current_inode_num);
+        load_inode(current_inode_num, inode);
+        inode_unlock(current_inode_num);
+    }
     if (inode_num) *inode_num = current_inode_num;
-    fprintf(stderr, "[DEBUG] traverse_path: Successfully traversed to path '%s' (inode %d)\n", path, current_inode_num);
-    free(path_copy);
+    TRACE(TRACE_DEBUG, "traverse_path: Successfully traversed to path '%s' (inode %d)", path, current_inode_num);
     return 0;
 }
 
 // FUSE initialization function
 static void *wfs_init(struct fuse_conn_info *conn) {
     (void) conn;
-    fprintf(stderr, "[DEBUG] init: Called\n");
+    TRACE(TRACE_DEBUG, "init: Called");
+
+    trace_start();
+    bitmap_init_summary();
+    stripe_start();
+    wb_start();
     
     struct wfs_inode root_inode;
     load_inode(0, &root_inode);
     
     if (!(root_inode.mode & S_IFDIR) || root_inode.size < sizeof(struct wfs_dentry) * 2) {
-        fprintf(stderr, "[DEBUG] init: Root inode not properly initialized. Initializing now.\n");
+        TRACE(TRACE_INFO, "init: Root inode not properly initialized. Initializing now.");
         // Initialize root inode as directory
         root_inode.mode = S_IFDIR | 0755;
         root_inode.nlinks = 2; // '.' and '..'
@@ -541,8 +3678,8 @@ static void *wfs_init(struct fuse_conn_info *conn) {
         root_inode.blocks[0] = block_num;
         
         // Initialize '.' and '..' entries
-        char block_buf[BLOCK_SIZE];
-        memset(block_buf, 0, BLOCK_SIZE);
+        char block_buf[block_size];
+        memset(block_buf, 0, block_size);
         
         struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
         
@@ -556,37 +3693,138 @@ static void *wfs_init(struct fuse_conn_info *conn) {
         entries[1].name[MAX_NAME - 1] = '\0';
         entries[1].num = 0; // Root inode number
         
-        raid_write(block_buf, block_num, BLOCK_SIZE);
+        meta_write_block(block_buf, block_num);
         
         // Store the updated root inode
         store_inode(0, &root_inode);
-        fprintf(stderr, "[DEBUG] init: Root inode initialized as directory with inode number 0\n");
-        
-        // Verify by dumping directory entries
-        print_directory_entries(0);
+        TRACE(TRACE_INFO, "init: Root inode initialized as directory with inode number 0");
     } else {
-        fprintf(stderr, "[DEBUG] init: Root inode already properly initialized\n");
-        // Optionally, verify directory entries
-        print_directory_entries(0);
+        TRACE(TRACE_DEBUG, "init: Root inode already properly initialized");
     }
-    
+
+    journal_start();
     return NULL;
 }
 
+// Statistics report and STATS_PATH
+//
+// STATS_PATH is not in any directory; getattr, open, read and release
+// recognise it by path. A handle reads the snapshot taken when it was
+// opened, and is direct_io so reads are not cut short at the size getattr
+// reported.
+static void stats_write(FILE *out) {
+    for (int op = 0; op < NUM_OPS; op++) {
+        stat_hist_write(out, op_names[op], "ns", &op_stats[op]);
+    }
+    for (int i = 0; i < num_disks; i++) {
+        fprintf(out, "disk %d: reads=%" PRIu64 " read_bytes=%" PRIu64 " writes=%" PRIu64 " write_bytes=%" PRIu64 "\n", i,
+                disk_reads[i], disk_read_bytes[i], disk_writes[i], disk_write_bytes[i]);
+    }
+    stat_hist_write(out, "inode_scan", "words", &inode_scan_stats);
+    stat_hist_write(out, "data_scan", "words", &data_scan_stats);
+    fprintf(out, "dcache: hits=%" PRIu64 " misses=%" PRIu64 "\n", dcache_hits, dcache_misses);
+    fprintf(out, "icache: stores=%" PRIu64 " timestamp_only=%" PRIu64 " atime_updates=%" PRIu64 " write_backs=%" PRIu64 "\n",
+            icache_stores, icache_lazy_stores, icache_atime_updates, icache_write_backs);
+    fprintf(out, "writeback: syncs=%" PRIu64 " ranges=%" PRIu64 " bytes=%" PRIu64 "\n", wb_syncs, wb_ranges, wb_bytes);
+    if (journal_enabled) {
+        fprintf(out, "journal: commits=%" PRIu64 " blocks=%" PRIu64 " unjournaled=%" PRIu64 "\n",
+                journal_commits, journal_blocks_logged, journal_overflows);
+    }
+    if (csum_enabled) {
+        fprintf(out, "raid1v: repaired=%" PRIu64 "\n", csum_repairs);
+    }
+}
+
+struct stats_snapshot {
+    char *text;
+    size_t len;
+};
+
+static struct stats_snapshot *stats_snapshot(void) {
+    struct stats_snapshot *snap = calloc(1, sizeof(*snap));
+    if (snap == NULL) {
+        return NULL;
+    }
+    FILE *out = open_memstream(&snap->text, &snap->len);
+    if (out == NULL) {
+        free(snap);
+        return NULL;
+    }
+    stats_write(out);
+    fclose(out);
+    return snap;
+}
+
+static void stats_free(struct stats_snapshot *snap) {
+    free(snap->text);
+    free(snap);
+}
+
+static int is_stats_path(const char *path) {
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+static int stats_getattr(struct stat *stbuf) {
+    struct stats_snapshot *snap = stats_snapshot();
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_size = snap->len;
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    stbuf->st_blksize = block_size;
+    stats_free(snap);
+    return 0;
+}
+
+static int stats_open(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    struct stats_snapshot *snap = stats_snapshot();
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t) snap;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int stats_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct stats_snapshot *snap = fi != NULL && fi->fh != 0 ? (struct stats_snapshot *)(uintptr_t) fi->fh : stats_snapshot();
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    size_t n = 0;
+    if (offset < (off_t) snap->len) {
+        n = snap->len - offset < size ? snap->len - offset : size;
+        memcpy(buf, snap->text + offset, n);
+    }
+    if (fi == NULL || fi->fh == 0) {
+        stats_free(snap);
+    }
+    return n;
+}
+
 // FUSE operations
 static int wfs_getattr(const char *path, struct stat *stbuf) {
-    fprintf(stderr, "[DEBUG] getattr called for path: '%s'\n", path);
+    TRACE(TRACE_DEBUG, "getattr called for path: '%s'", path);
     memset(stbuf, 0, sizeof(struct stat));
+    if (is_stats_path(path)) {
+        return stats_getattr(stbuf);
+    }
 
     struct wfs_inode inode;
     int res = traverse_path(path, &inode, NULL);
     if (res != 0) {
-        fprintf(stderr, "[DEBUG] getattr error: traverse_path failed for path '%s' with error %d\n", path, res);
+        TRACE(TRACE_DEBUG, "getattr error: traverse_path failed for path '%s' with error %d", path, res);
         return res;
     }
-
     // Log retrieved inode information
-    fprintf(stderr, "[DEBUG] getattr: Retrieved inode for path '%s': mode=%o, nlinks=%d, uid=%d, gid=%d, size=%ld, atim=%ld, mtim=%ld, ctim=%ld\n",
+    TRACE(TRACE_DEBUG, "getattr: Retrieved inode for path '%s': mode=%o, nlinks=%d, uid=%d, gid=%d, size=%ld, atim=%ld, mtim=%ld, ctim=%ld",
             path, inode.mode, inode.nlinks, inode.uid, inode.gid, inode.size,
             inode.atim, inode.mtim, inode.ctim);
 
@@ -598,22 +3836,25 @@ static int wfs_getattr(const char *path, struct stat *stbuf) {
     stbuf->st_atime = inode.atim;
     stbuf->st_mtime = inode.mtim;
     stbuf->st_ctime = inode.ctim;
-    stbuf->st_blocks = (inode.size + 511) / 512;
-    stbuf->st_blksize = 512;
+    // Inline contents take no data blocks, nor do a file's holes
+    if (S_ISREG(inode.mode) && block_count_enabled) {
+        stbuf->st_blocks = (blkcnt_t) inode.nblocks * (block_size / 512);
+    } else {
+        stbuf->st_blocks = inode_is_inline(&inode) ? 0 : (inode.size + 511) / 512;
+    }
+    stbuf->st_blksize = block_size;
 
-    fprintf(stderr, "[DEBUG] getattr: Completed for path '%s'\n", path);
+    TRACE(TRACE_DEBUG, "getattr: Completed for path '%s'", path);
     return 0;
 }
 
-int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    (void) dev; // Unused parameter
-
-    fprintf(stderr, "[DEBUG] wfs_mknod: Called with path='%s', mode=%o\n", path, mode);
+static int make_node(const char *path, mode_t mode) {
+    TRACE(TRACE_DEBUG, "wfs_mknod: Called with path='%s', mode=%o", path, mode);
 
     char *path_copy1 = strdup(path);
     char *path_copy2 = strdup(path);
     if (!path_copy1 || !path_copy2) {
-        fprintf(stderr, "[ERROR] wfs_mknod: strdup failed for path '%s'\n", path);
+        TRACE(TRACE_ERROR, "wfs_mknod: strdup failed for path '%s'", path);
         free(path_copy1);
         free(path_copy2);
         return -ENOMEM;
@@ -624,40 +3865,47 @@ int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
     char dir_path[strlen(dir_name) + 1];
     strcpy(dir_path, dir_name);
 
-    fprintf(stderr, "[DEBUG] wfs_mknod: Directory path='%s', Base name='%s'\n", dir_path, base_name);
+    TRACE(TRACE_DEBUG, "wfs_mknod: Directory path='%s', Base name='%s'", dir_path, base_name);
 
     struct wfs_inode parent_inode;
     int parent_inode_num;
-    int res = traverse_path(dir_path, &parent_inode, &parent_inode_num);
+    int res = traverse_path(dir_path, NULL, &parent_inode_num);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_mknod: Failed to traverse to parent directory '%s' with error %d\n", dir_path, res);
+        TRACE(TRACE_DEBUG, "wfs_mknod: Failed to traverse to parent directory '%s' with error %d", dir_path, res);
         free(path_copy1);
         free(path_copy2);
         return res;
     }
 
+    // The parent stays write-locked until the new entry is in place
+    inode_wrlock(parent_inode_num);
+    load_inode(parent_inode_num, &parent_inode);
+
     if ((parent_inode.mode & S_IFDIR) == 0) {
-        fprintf(stderr, "[ERROR] wfs_mknod: Parent path '%s' is not a directory\n", dir_path);
+        TRACE(TRACE_ERROR, "wfs_mknod: Parent path '%s' is not a directory", dir_path);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return -ENOTDIR;
     }
 
     // Check if file already exists
-    res = find_dentry(&parent_inode, base_name, NULL);
+    res = lookup_dentry_locked(parent_inode_num, base_name, NULL, NULL);
     if (res == 0) {
-        fprintf(stderr, "[ERROR] wfs_mknod: File '%s' already exists in directory inode %d\n", base_name, parent_inode.num);
+        TRACE(TRACE_DEBUG, "wfs_mknod: File '%s' already exists in directory inode %d", base_name, parent_inode.num);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return -EEXIST;
     }
 
     // Allocate new inode
     int new_inode_num = allocate_inode();
     if (new_inode_num < 0) {
-        fprintf(stderr, "[ERROR] wfs_mknod: Failed to allocate inode for '%s'\n", base_name);
+        TRACE(TRACE_ERROR, "wfs_mknod: Failed to allocate inode for '%s'", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return new_inode_num;
     }
 
@@ -669,15 +3917,21 @@ int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
     new_inode.gid = getgid();
     new_inode.size = 0; // **Set size to 0 for lazy allocation**
     new_inode.atim = new_inode.mtim = new_inode.ctim = time(NULL);
+    if (inline_enabled) {
+        // The slot may still hold a freed inode's contents
+        new_inode.flags = WFS_INODE_INLINE;
+        inline_write(new_inode_num, NULL, 0, INLINE_MAX);
+    }
 
     if (mode & S_IFDIR) {
         // Directory-specific initialization
         new_inode.nlinks = 2;  // '.' and '..'
-        fprintf(stderr, "[DEBUG] wfs_mknod: Initialized directory inode %d with nlinks=%d\n", new_inode_num, new_inode.nlinks);
+        TRACE(TRACE_DEBUG, "wfs_mknod: Initialized directory inode %d with nlinks=%d", new_inode_num, new_inode.nlinks);
+        parent_inode.nlinks++;  // The new directory's '..'
     } else {
         // Regular file
         new_inode.nlinks = 1;
-        fprintf(stderr, "[DEBUG] wfs_mknod: Initialized file inode %d with nlinks=%d\n", new_inode_num, new_inode.nlinks);
+        TRACE(TRACE_DEBUG, "wfs_mknod: Initialized file inode %d with nlinks=%d", new_inode_num, new_inode.nlinks);
     }
 
     // Store new inode
@@ -687,48 +3941,81 @@ int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
     res = add_dentry(&parent_inode, base_name, new_inode_num);
     if (res != 0) {
         // If we failed to add the directory entry, free the inode
-        fprintf(stderr, "[ERROR] wfs_mknod: Failed to add dentry for '%s' with error %d\n", base_name, res);
+        TRACE(TRACE_ERROR, "wfs_mknod: Failed to add dentry for '%s' with error %d", base_name, res);
         free_inode(new_inode_num);
         // If it was a directory and we incremented parent's link count, revert it
         if (mode & S_IFDIR) {
             parent_inode.nlinks--;
             store_inode(parent_inode_num, &parent_inode);
-            fprintf(stderr, "[DEBUG] wfs_mknod: Reverted parent's link count for inode %d\n", parent_inode_num);
+            TRACE(TRACE_DEBUG, "wfs_mknod: Reverted parent's link count for inode %d", parent_inode_num);
         }
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return res;
     }
 
     // Update parent inode times
     parent_inode.mtim = parent_inode.ctim = time(NULL);
     store_inode(parent_inode_num, &parent_inode);
-    fprintf(stderr, "[DEBUG] wfs_mknod: Updated parent inode %d's mtim and ctim\n", parent_inode_num);
+    TRACE(TRACE_DEBUG, "wfs_mknod: Updated parent inode %d's mtim and ctim", parent_inode_num);
+
+    // The getattr that follows a create can be answered from the cache
+    dcache_insert(parent_inode_num, base_name, new_inode_num, mode);
+    inode_unlock(parent_inode_num);
 
     free(path_copy1);
     free(path_copy2);
-    fprintf(stderr, "[DEBUG] wfs_mknod: Successfully created '%s' (inode %d)\n", path, new_inode_num);
+    TRACE(TRACE_DEBUG, "wfs_mknod: Successfully created '%s' (inode %d)", path, new_inode_num);
     return 0;
 }
 
+int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    (void) dev; // Unused parameter
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
+    int res, retries = 0;
+    do {
+        journal_begin();
+        res = make_node(path, mode);
+        journal_end();
+    } while (journal_should_retry(res, &retries));
+    return res;
+}
+
 static int wfs_mkdir(const char *path, mode_t mode) {
-    fprintf(stderr, "[DEBUG] wfs_mkdir: Called with path='%s', mode=%o\n", path, mode);
+    TRACE(TRACE_DEBUG, "wfs_mkdir: Called with path='%s', mode=%o", path, mode);
     int res = wfs_mknod(path, mode | S_IFDIR, 0);
     if (res == 0) {
-        fprintf(stderr, "[DEBUG] wfs_mkdir: Successfully created directory '%s'\n", path);
+        TRACE(TRACE_DEBUG, "wfs_mkdir: Successfully created directory '%s'", path);
     } else {
-        fprintf(stderr, "[ERROR] wfs_mkdir: Failed to create directory '%s' with error %d\n", path, res);
+        TRACE(TRACE_DEBUG, "wfs_mkdir: Failed to create directory '%s' with error %d", path, res);
     }
     return res;
 }
 
-static int wfs_unlink(const char *path) {
-    fprintf(stderr, "[DEBUG] wfs_unlink: Called with path='%s'\n", path);
+// Frees a file whose last name is gone: its data and pointer blocks, then
+// the inode. Caller holds its write lock.
+static void free_file_inode(struct wfs_inode *inode) {
+    truncate_file_blocks(inode, 0);
+    free_inode(inode->num);
+}
+
+// Frees an empty directory's blocks and inode. Caller holds its write lock.
+static void free_dir_inode(struct wfs_inode *dir) {
+    dir_free_blocks(dir);
+    free_inode(dir->num);
+    dcache_invalidate_dir(dir->num);
+}
+
+static int unlink_node(const char *path) {
+    TRACE(TRACE_DEBUG, "wfs_unlink: Called with path='%s'", path);
 
     char *path_copy1 = strdup(path);
     char *path_copy2 = strdup(path);
     if (!path_copy1 || !path_copy2) {
-        fprintf(stderr, "[ERROR] wfs_unlink: strdup failed for path '%s'\n", path);
+        TRACE(TRACE_ERROR, "wfs_unlink: strdup failed for path '%s'", path);
         free(path_copy1);
         free(path_copy2);
         return -ENOMEM;
@@ -739,84 +4026,105 @@ static int wfs_unlink(const char *path) {
     char dir_path[strlen(dir_name) + 1];
     strcpy(dir_path, dir_name);
 
-    fprintf(stderr, "[DEBUG] wfs_unlink: Directory path='%s', Base name='%s'\n", dir_path, base_name);
+    TRACE(TRACE_DEBUG, "wfs_unlink: Directory path='%s', Base name='%s'", dir_path, base_name);
 
     struct wfs_inode parent_inode;
     int parent_inode_num;
-    int res = traverse_path(dir_path, &parent_inode, &parent_inode_num);
+    int res = traverse_path(dir_path, NULL, &parent_inode_num);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_unlink: Failed to traverse to parent directory '%s' with error %d\n", dir_path, res);
+        TRACE(TRACE_DEBUG, "wfs_unlink: Failed to traverse to parent directory '%s' with error %d", dir_path, res);
         free(path_copy1);
         free(path_copy2);
         return res;
     }
 
-    struct wfs_dentry dentry;
-    res = find_dentry(&parent_inode, base_name, &dentry);
+    // Lock the parent, then the target (parent before child)
+    inode_wrlock(parent_inode_num);
+    load_inode(parent_inode_num, &parent_inode);
+
+    int target_inode_num;
+    res = lookup_dentry_locked(parent_inode_num, base_name, &target_inode_num, NULL);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_unlink: File '%s' not found in directory inode %d\n", base_name, parent_inode.num);
+        TRACE(TRACE_DEBUG, "wfs_unlink: File '%s' not found in directory inode %d", base_name, parent_inode.num);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return res;
     }
 
     // Load inode to be unlinked
     struct wfs_inode target_inode;
-    load_inode(dentry.num, &target_inode);
+    inode_wrlock(target_inode_num);
+    load_inode(target_inode_num, &target_inode);
 
     if ((target_inode.mode & S_IFDIR) != 0) {
-        fprintf(stderr, "[ERROR] wfs_unlink: '%s' is a directory, not a file\n", base_name);
+        TRACE(TRACE_DEBUG, "wfs_unlink: '%s' is a directory, not a file", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(target_inode_num);
+        inode_unlock(parent_inode_num);
         return -EISDIR;
     }
 
     // Remove dentry from parent directory
     res = remove_dentry(&parent_inode, base_name);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_unlink: Failed to remove dentry for '%s'\n", base_name);
+        TRACE(TRACE_ERROR, "wfs_unlink: Failed to remove dentry for '%s'", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(target_inode_num);
+        inode_unlock(parent_inode_num);
         return res;
     }
 
-    // Free direct data blocks
-    for (int i = 0; i < D_BLOCK; i++) {
-        if (target_inode.blocks[i] != 0) {
-            free_data_block(target_inode.blocks[i]);
-            target_inode.blocks[i] = 0;
-        }
-    }
-
-    // Free indirect blocks
-    res = free_indirect_blocks(&target_inode);
-    if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_unlink: Failed to free indirect blocks for inode %d\n", target_inode.num);
-        // Proceeding even if indirect blocks failed to free
-    }
-
-    // Free inode
-    free_inode(target_inode.num);
-    fprintf(stderr, "[DEBUG] wfs_unlink: Freed inode %d and its data blocks\n", target_inode.num);
+    free_file_inode(&target_inode);
+    TRACE(TRACE_DEBUG, "wfs_unlink: Freed inode %d and its data blocks", target_inode.num);
 
     // Update parent inode times
     parent_inode.mtim = parent_inode.ctim = time(NULL);
     store_inode(parent_inode_num, &parent_inode);
-    fprintf(stderr, "[DEBUG] wfs_unlink: Updated parent inode %d's mtim and ctim\n", parent_inode_num);
+    TRACE(TRACE_DEBUG, "wfs_unlink: Updated parent inode %d's mtim and ctim", parent_inode_num);
+
+    inode_unlock(target_inode_num);
+    inode_unlock(parent_inode_num);
 
     free(path_copy1);
     free(path_copy2);
-    fprintf(stderr, "[DEBUG] wfs_unlink: Successfully unlinked '%s'\n", path);
+    TRACE(TRACE_DEBUG, "wfs_unlink: Successfully unlinked '%s'", path);
     return 0;
 }
 
-static int wfs_rmdir(const char *path) {
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Called with path='%s'\n", path);
+static int wfs_unlink(const char *path) {
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
+    journal_begin();
+    int res = unlink_node(path);
+    journal_end();
+    return res;
+}
+
+// Stops the walk at the first entry other than '.' and '..'
+static int block_has_entries(off_t block, struct wfs_dentry *entries, void *arg) {
+    (void) block;
+    (void) arg;
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (strlen(entries[j].name) != 0 &&
+            strcmp(entries[j].name, ".") != 0 && strcmp(entries[j].name, "..") != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int remove_dir(const char *path) {
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Called with path='%s'", path);
 
     char *path_copy1 = strdup(path);
     char *path_copy2 = strdup(path);
     if (!path_copy1 || !path_copy2) {
-        fprintf(stderr, "[ERROR] wfs_rmdir: strdup failed for path '%s'\n", path);
+        TRACE(TRACE_ERROR, "wfs_rmdir: strdup failed for path '%s'", path);
         free(path_copy1);
         free(path_copy2);
         return -ENOMEM;
@@ -827,352 +4135,1086 @@ static int wfs_rmdir(const char *path) {
     char dir_path[strlen(dir_name) + 1];
     strcpy(dir_path, dir_name);
 
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Directory path='%s', Base name='%s'\n", dir_path, base_name);
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Directory path='%s', Base name='%s'", dir_path, base_name);
 
     struct wfs_inode parent_inode;
     int parent_inode_num;
-    int res = traverse_path(dir_path, &parent_inode, &parent_inode_num);
+    int res = traverse_path(dir_path, NULL, &parent_inode_num);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_rmdir: Failed to traverse to parent directory '%s' with error %d\n", dir_path, res);
+        TRACE(TRACE_DEBUG, "wfs_rmdir: Failed to traverse to parent directory '%s' with error %d", dir_path, res);
         free(path_copy1);
         free(path_copy2);
         return res;
     }
 
-    struct wfs_dentry dentry;
-    res = find_dentry(&parent_inode, base_name, &dentry);
+    // Lock the parent, then the target (parent before child)
+    inode_wrlock(parent_inode_num);
+    load_inode(parent_inode_num, &parent_inode);
+
+    int target_inode_num;
+    res = lookup_dentry_locked(parent_inode_num, base_name, &target_inode_num, NULL);
     if (res != 0) {
-        fprintf(stderr, "[ERROR] wfs_rmdir: Directory '%s' not found in directory inode %d\n", base_name, parent_inode.num);
+        TRACE(TRACE_DEBUG, "wfs_rmdir: Directory '%s' not found in directory inode %d", base_name, parent_inode.num);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(parent_inode_num);
         return res;
     }
 
     // Load inode to be removed
     struct wfs_inode target_inode;
-    load_inode(dentry.num, &target_inode);
+    inode_wrlock(target_inode_num);
+    load_inode(target_inode_num, &target_inode);
 
     if ((target_inode.mode & S_IFDIR) == 0) {
-        fprintf(stderr, "[ERROR] wfs_rmdir: '%s' is not a directory\n", base_name);
+        TRACE(TRACE_DEBUG, "wfs_rmdir: '%s' is not a directory", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(target_inode_num);
+        inode_unlock(parent_inode_num);
         return -ENOTDIR;
     }
 
     // Check if directory is empty
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
-    int is_empty = 1;
-    for (int i = 0; i < N_BLOCKS; i++) {
-        if (target_inode.blocks[i] == 0) continue;
-        char block_buf[BLOCK_SIZE];
-        raid_read(block_buf, target_inode.blocks[i], BLOCK_SIZE);
-        struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
-        for (int j = 0; j < entries_per_block; j++) {
-            if (strlen(entries[j].name) != 0) {
-                // Allow only '.' and '..' if they exist
-                if (strcmp(entries[j].name, ".") != 0 && strcmp(entries[j].name, "..") != 0) {
-                    is_empty = 0;
-                    break;
-                }
-            }
-        }
-        if (!is_empty) break;
-    }
-    if (!is_empty) {
-        fprintf(stderr, "[ERROR] wfs_rmdir: Directory '%s' is not empty\n", base_name);
+    if (dir_for_each_block(&target_inode, block_has_entries, NULL)) {
+        TRACE(TRACE_DEBUG, "wfs_rmdir: Directory '%s' is not empty", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(target_inode_num);
+        inode_unlock(parent_inode_num);
         return -ENOTEMPTY;
     }
 
     // Remove dentry from parent directory
     res = remove_dentry(&parent_inode, base_name);
     if (res != 0) {
-       //fprintf(stderr, "[ERROR] wfs_rmdir: Failed to remove dentry for directory '%s'\n", base_name, res);
+        TRACE(TRACE_ERROR, "wfs_rmdir: Failed to remove dentry for directory '%s'", base_name);
         free(path_copy1);
         free(path_copy2);
+        inode_unlock(target_inode_num);
+        inode_unlock(parent_inode_num);
         return res;
     }
 
     // Decrement parent's link count
     parent_inode.nlinks--;
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Decremented parent inode %d's nlinks to %d\n", parent_inode_num, parent_inode.nlinks);
-
-    // Free data blocks of directory
-    for (int i = 0; i < N_BLOCKS; i++) {
-        if (target_inode.blocks[i] != 0) {
-            free_data_block(target_inode.blocks[i]);
-            target_inode.blocks[i] = 0;
-        }
-    }
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Decremented parent inode %d's nlinks to %d", parent_inode_num, parent_inode.nlinks);
 
-    // Free inode
-    free_inode(target_inode.num);
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Freed inode %d and its data blocks\n", target_inode.num);
+    free_dir_inode(&target_inode);
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Freed inode %d and its data blocks", target_inode.num);
 
     // Update parent inode times
     parent_inode.mtim = parent_inode.ctim = time(NULL);
     store_inode(parent_inode_num, &parent_inode);
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Updated parent inode %d's mtim and ctim\n", parent_inode_num);
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Updated parent inode %d's mtim and ctim", parent_inode_num);
+
+    inode_unlock(target_inode_num);
+    inode_unlock(parent_inode_num);
 
     free(path_copy1);
     free(path_copy2);
-    fprintf(stderr, "[DEBUG] wfs_rmdir: Successfully removed directory '%s'\n", path);
+    TRACE(TRACE_DEBUG, "wfs_rmdir: Successfully removed directory '%s'", path);
     return 0;
 }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) fi; // Unused parameter
-    fprintf(stderr, "[DEBUG] wfs_read: Called with path='%s', size=%zu, offset=%ld\n", path, size, offset);
+static int wfs_rmdir(const char *path) {
+    journal_begin();
+    int res = remove_dir(path);
+    journal_end();
+    return res;
+}
+
+// Renames that move entries between directories hold this, so no two of
+// them lock a pair of directories in opposite orders
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns 1 if path names dir or something below it
+static int path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    if (strcmp(dir, "/") == 0) return 1;
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Moves the entry for from to the name to. Only the directory entries
+// change: the new entry refers to the same inode (an existing one is
+// repointed in place), the old one is removed, and a replaced file or
+// empty directory is freed. Directories are locked ancestor first, then the
+// replaced inode.
+static int rename_node(const char *from, const char *to) {
+    TRACE(TRACE_DEBUG, "wfs_rename: Called with from='%s', to='%s'", from, to);
+
+    char *from_copy1 = strdup(from);
+    char *from_copy2 = strdup(from);
+    char *to_copy1 = strdup(to);
+    char *to_copy2 = strdup(to);
+    if (!from_copy1 || !from_copy2 || !to_copy1 || !to_copy2) {
+        TRACE(TRACE_ERROR, "wfs_rename: strdup failed for '%s' -> '%s'", from, to);
+        free(from_copy1);
+        free(from_copy2);
+        free(to_copy1);
+        free(to_copy2);
+        return -ENOMEM;
+    }
+    char *src_dir_path = dirname(from_copy1);
+    char *src_name = basename(from_copy2);
+    char *dst_dir_path = dirname(to_copy1);
+    char *dst_name = basename(to_copy2);
+
+    int src_dir_num, dst_dir_num;
+    int res = traverse_path(src_dir_path, NULL, &src_dir_num);
+    if (res == 0) {
+        res = traverse_path(dst_dir_path, NULL, &dst_dir_num);
+    }
+    if (res != 0) {
+        TRACE(TRACE_DEBUG, "wfs_rename: Failed to traverse to a parent directory with error %d", res);
+        free(from_copy1);
+        free(from_copy2);
+        free(to_copy1);
+        free(to_copy2);
+        return res;
+    }
+
+    struct wfs_inode src_dir, dst_dir_copy;
+    struct wfs_inode *dst_dir = &src_dir;
+    int first = src_dir_num, second = -1;
+    if (dst_dir_num != src_dir_num) {
+        dst_dir = &dst_dir_copy;
+        pthread_mutex_lock(&rename_lock);
+        // An ancestor before its descendant, as elsewhere; otherwise by number
+        second = dst_dir_num;
+        if (path_within(src_dir_path, dst_dir_path) ||
+            (!path_within(dst_dir_path, src_dir_path) && dst_dir_num < src_dir_num)) {
+            first = dst_dir_num;
+            second = src_dir_num;
+        }
+    }
+    inode_wrlock(first);
+    if (second >= 0) {
+        inode_wrlock(second);
+    }
+    load_inode(src_dir_num, &src_dir);
+    if (dst_dir != &src_dir) {
+        load_inode(dst_dir_num, dst_dir);
+    }
+
+    int src_num, target_num = -1;
+    mode_t src_mode = 0, target_mode = 0;
+    if ((src_dir.mode & S_IFDIR) == 0 || (dst_dir->mode & S_IFDIR) == 0) {
+        res = -ENOTDIR;
+    } else {
+        res = lookup_dentry_locked(src_dir_num, src_name, &src_num, &src_mode);
+    }
+    if (res == 0 && (src_mode & S_IFDIR) && path_within(to, from)) {
+        // A directory cannot move below itself
+        res = -EINVAL;
+    }
+    if (res == 0) {
+        res = lookup_dentry_locked(dst_dir_num, dst_name, &target_num, &target_mode);
+        if (res == -ENOENT) {
+            target_num = -1;
+            res = 0;
+        }
+    }
+    if (res == 0 && target_num >= 0) {
+        if (target_num == src_num) {
+            res = 1;   // Both names already refer to the same inode
+        } else if ((src_mode & S_IFDIR) && !(target_mode & S_IFDIR)) {
+            res = -ENOTDIR;
+        } else if (!(src_mode & S_IFDIR) && (target_mode & S_IFDIR)) {
+            res = -EISDIR;
+        } else if ((target_mode & S_IFDIR) && path_within(src_dir_path, to)) {
+            // The target holds the source, so it is not empty (and is
+            // already locked, or is an ancestor of a locked directory)
+            res = -ENOTEMPTY;
+        }
+    }
+
+    struct wfs_inode target;
+    int target_locked = res == 0 && target_num >= 0;
+    if (target_locked) {
+        inode_wrlock(target_num);
+        load_inode(target_num, &target);
+        if ((target.mode & S_IFDIR) && dir_for_each_block(&target, block_has_entries, NULL)) {
+            TRACE(TRACE_DEBUG, "wfs_rename: Directory '%s' is not empty", to);
+            res = -ENOTEMPTY;
+        }
+    }
+
+    if (res == 0) {
+        if (target_locked) {
+            res = replace_dentry(dst_dir, dst_name, src_num);
+        } else {
+            res = add_dentry(dst_dir, dst_name, src_num);
+        }
+    }
+    if (res == 0) {
+        res = remove_dentry(&src_dir, src_name);
+        if (res != 0) {
+            // Put the target name back so the inode is not left under both names
+            TRACE(TRACE_ERROR, "wfs_rename: Failed to remove dentry for '%s'", from);
+            if (target_locked) {
+                replace_dentry(dst_dir, dst_name, target_num);
+            } else if (remove_dentry(dst_dir, dst_name) == 0) {
+                store_inode(dst_dir_num, dst_dir);
+            }
+        }
+    }
+    if (res == 0) {
+        if (target_locked) {
+            if (target.mode & S_IFDIR) {
+                dst_dir->nlinks--;
+                free_dir_inode(&target);
+            } else {
+                free_file_inode(&target);
+            }
+            TRACE(TRACE_DEBUG, "wfs_rename: Freed replaced inode %d", target_num);
+        }
+        if ((src_mode & S_IFDIR) && dst_dir != &src_dir) {
+            src_dir.nlinks--;
+            dst_dir->nlinks++;
+        }
+        time_t now = time(NULL);
+        struct wfs_inode moved;
+        inode_wrlock(src_num);
+        load_inode(src_num, &moved);
+        moved.ctim = now;
+        store_inode(src_num, &moved);
+        inode_unlock(src_num);
+        src_dir.mtim = src_dir.ctim = now;
+        store_inode(src_dir_num, &src_dir);
+        if (dst_dir != &src_dir) {
+            dst_dir->mtim = dst_dir->ctim = now;
+            store_inode(dst_dir_num, dst_dir);
+        }
+        dcache_insert(dst_dir_num, dst_name, src_num, src_mode);
+        TRACE(TRACE_DEBUG, "wfs_rename: Moved inode %d from '%s' to '%s'", src_num, from, to);
+    }
+
+    if (target_locked) {
+        inode_unlock(target_num);
+    }
+    if (second >= 0) {
+        inode_unlock(second);
+        pthread_mutex_unlock(&rename_lock);
+    }
+    inode_unlock(first);
+    free(from_copy1);
+    free(from_copy2);
+    free(to_copy1);
+    free(to_copy2);
+    return res > 0 ? 0 : res;
+}
+
+static int wfs_rename(const char *from, const char *to) {
+    if (is_stats_path(from) || is_stats_path(to)) {
+        return -EPERM;
+    }
+    if (strcmp(from, to) == 0) {
+        return 0;
+    }
+    int res, retries = 0;
+    do {
+        journal_begin();
+        res = rename_node(from, to);
+        journal_end();
+    } while (journal_should_retry(res, &retries));
+    return res;
+}
+
+int resolve_open_file(const char *path, struct fuse_file_info *fi, struct wfs_open_file **ofp) {
+    if (fi != NULL && fi->fh != 0) {
+        *ofp = (struct wfs_open_file *)(uintptr_t) fi->fh;
+        return 0;
+    }
+
+    int inode_num;
+    int res = traverse_path(path, NULL, &inode_num);
+    if (res != 0) {
+        return res;
+    }
+    *ofp = open_file_get(inode_num, 1);
+    return *ofp ? 0 : -ENOMEM;
+}
+
+void release_open_file(struct fuse_file_info *fi, struct wfs_open_file *of) {
+    if (fi == NULL || fi->fh == 0) {
+        open_file_put(of);
+    }
+}
+
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_open: Called with path='%s'", path);
+    if (is_stats_path(path)) {
+        return stats_open(fi);
+    }
 
     struct wfs_inode inode;
-    int res = traverse_path(path, &inode, NULL);
+    int inode_num;
+    int res = traverse_path(path, &inode, &inode_num);
+    if (res != 0) {
+        return res;
+    }
+    if ((inode.mode & S_IFDIR) != 0) {
+        return -EISDIR;
+    }
+
+    struct wfs_open_file *of = open_file_get(inode_num, 1);
+    if (!of) {
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t) of;
+    if ((fi->flags & O_TRUNC) && inode.size > 0) {
+        res = wfs_ftruncate(path, 0, fi);
+        if (res != 0) {
+            open_file_put(of);
+            fi->fh = 0;
+            return res;
+        }
+    }
+    TRACE(TRACE_DEBUG, "wfs_open: Opened inode %d", inode_num);
+    return 0;
+}
+
+static int wfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_create: Called with path='%s', mode=%o", path, mode);
+    int res = wfs_mknod(path, mode, 0);
+    if (res != 0) {
+        return res;
+    }
+    return wfs_open(path, fi);
+}
+
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    if (fi->fh != 0 && is_stats_path(path)) {
+        stats_free((struct stats_snapshot *)(uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    if (fi->fh != 0) {
+        open_file_put((struct wfs_open_file *)(uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    return 0;
+}
+
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_read: Called with path='%s', size=%zu, offset=%ld", path, size, offset);
+    if (is_stats_path(path)) {
+        return stats_read(buf, size, offset, fi);
+    }
+
+    struct wfs_open_file *of;
+    int res = resolve_open_file(path, fi, &of);
     if (res != 0) {
-        fprintf(stderr, "[DEBUG] wfs_read error: traverse_path failed for path '%s' with error %d\n", path, res);
+        TRACE(TRACE_DEBUG, "wfs_read error: traverse_path failed for path '%s' with error %d", path, res);
         return res;
     }
 
+    struct wfs_inode inode;
+    inode_rdlock(of->inode_num);
+    load_inode(of->inode_num, &inode);
+
     if ((inode.mode & S_IFREG) == 0) {
-        fprintf(stderr, "[ERROR] wfs_read: '%s' is not a regular file\n", path);
+        TRACE(TRACE_DEBUG, "wfs_read: '%s' is not a regular file", path);
+        inode_unlock(of->inode_num);
+        release_open_file(fi, of);
         return -EISDIR;
     }
+    inode_accessed(of->inode_num, &inode);
+
+    if (offset >= inode.size) {
+        TRACE(TRACE_DEBUG, "wfs_read: Offset %ld >= file size %ld, returning 0 bytes", offset, inode.size);
+        inode_unlock(of->inode_num);
+        release_open_file(fi, of);
+        return 0;
+    }
+
+    if (offset + size > inode.size) {
+        size = inode.size - offset;
+    }
+
+    if (inode_is_inline(&inode)) {
+        inline_read(inode.num, buf, offset, size);
+        inode_unlock(of->inode_num);
+        release_open_file(fi, of);
+        TRACE(TRACE_DEBUG, "wfs_read: Read %zu inline bytes from '%s'", size, path);
+        return size;
+    }
+
+    size_t bytes_read = 0;
+    while (size > 0) {
+        if (offset / block_size >= max_file_blocks) {
+            // Past the largest file this image supports
+            TRACE(TRACE_ERROR, "wfs_read: Exceeds maximum file size for '%s'", path);
+            break;
+        }
+        int first = offset / block_size;
+        size_t block_offset = offset % block_size;
+
+        int count = (block_offset + size + block_size - 1) / block_size;
+        if (count > EXTENT_BATCH) count = EXTENT_BATCH;
+        if (count > max_file_blocks - first) count = max_file_blocks - first;
+
+        off_t blocks[EXTENT_BATCH];
+        int err;
+        // Holes map to block 0 and read as zeroes
+        int mapped = map_file_blocks(&inode, of, first, count, blocks, MAP_HOLES, &err);
+        if (mapped == 0) {
+            TRACE(TRACE_ERROR, "wfs_read: Failed to map block %d of '%s': %d", first, path, err);
+            break;
+        }
+
+        size_t to_read = (size_t) mapped * block_size - block_offset;
+        if (to_read > size) {
+            to_read = size;
+        }
+        copy_extents(buf + bytes_read, blocks, mapped, block_offset, to_read, 0);
+
+        size -= to_read;
+        offset += to_read;
+        bytes_read += to_read;
+        if (mapped < count) break;
+    }
+
+    inode_unlock(of->inode_num);
+    release_open_file(fi, of);
+    TRACE(TRACE_DEBUG, "wfs_read: Read %zu bytes from '%s'", bytes_read, path);
+    return bytes_read;
+}
+
+// Moves an inline file's contents into its first data block. Caller holds
+// the inode's write lock and stores the inode.
+static int inline_file_to_blocks(struct wfs_inode *inode, struct wfs_open_file *of) {
+    if (inode->size > 0) {
+        // The whole block is written so no stale bytes follow the contents
+        char block_buf[block_size];
+        memset(block_buf, 0, block_size);
+        inline_read(inode->num, block_buf, 0, inode->size);
+        off_t block;
+        int err;
+        if (map_file_blocks(inode, of, 0, 1, &block, MAP_ALLOC, &err) == 0) {
+            return err;
+        }
+        copy_extents(block_buf, &block, 1, 0, block_size, 1);
+    }
+    inode->flags &= ~WFS_INODE_INLINE;
+    inline_write(inode->num, NULL, 0, INLINE_MAX);
+    TRACE(TRACE_DEBUG, "inline_file_to_blocks: Moved %ld bytes of inode %d to blocks", inode->size, inode->num);
+    return 0;
+}
+
+// Allocates file block index zero-filled if it is a hole, for a write that
+// covers only part of it. Caller holds the inode's write lock.
+static int zero_partial_hole(struct wfs_inode *inode, struct wfs_open_file *of, int index) {
+    off_t block;
+    int err;
+    if (map_file_blocks(inode, of, index, 1, &block, MAP_HOLES, &err) == 0) {
+        return err;
+    }
+    if (block == 0 && map_file_blocks(inode, of, index, 1, &block, MAP_ZERO, &err) == 0) {
+        return err;
+    }
+    return 0;
+}
+
+// Zeroes [from, to), which lies within one block, unless the block is a
+// hole. Caller holds the inode's write lock.
+static int zero_block_range(struct wfs_inode *inode, struct wfs_open_file *of, off_t from, off_t to) {
+    off_t block;
+    int err;
+    if (map_file_blocks(inode, of, from / block_size, 1, &block, MAP_HOLES, &err) == 0) {
+        return err;
+    }
+    if (block != 0) {
+        char zero_block[block_size];
+        memset(zero_block, 0, block_size);
+        copy_extents(zero_block, &block, 1, from % block_size, to - from, 1);
+    }
+    return 0;
+}
+
+// Bytes past the end of file in its last block are not kept zero, so before
+// the file grows the part of [inode->size, end) in that block is zeroed.
+// Inline files keep those bytes zero already. Caller holds the inode's write
+// lock.
+static int zero_eof_tail(struct wfs_inode *inode, struct wfs_open_file *of, off_t end) {
+    if (inode_is_inline(inode) || end <= inode->size || inode->size % block_size == 0) {
+        return 0;
+    }
+    off_t block_end = (inode->size / block_size + 1) * block_size;
+    return zero_block_range(inode, of, inode->size, end < block_end ? end : block_end);
+}
+
+// Writes size bytes at offset under the inode's write lock and updates the
+// inode. Returns the bytes written; the error that stopped it short, if any,
+// is left in *err.
+static size_t write_range(struct wfs_open_file *of, const char *path, const char *buf, size_t size, off_t offset, int *err) {
+    struct wfs_inode inode;
+    inode_wrlock(of->inode_num);
+    load_inode(of->inode_num, &inode);
+
+    if ((inode.mode & S_IFREG) == 0) {
+        TRACE(TRACE_DEBUG, "wfs_write: '%s' is not a regular file", path);
+        inode_unlock(of->inode_num);
+        *err = -EISDIR;
+        return 0;
+    }
 
-    if (offset >= inode.size) {
-        fprintf(stderr, "[DEBUG] wfs_read: Offset %ld >= file size %ld, returning 0 bytes\n", offset, inode.size);
-        return 0;
+    size_t bytes_written = 0;
+    *err = 0;
+    if (inode_is_inline(&inode)) {
+        if (offset + (off_t) size <= (off_t) INLINE_MAX) {
+            inline_write(inode.num, buf, offset, size);
+            bytes_written = size;
+            offset += size;
+            size = 0;
+        } else {
+            *err = inline_file_to_blocks(&inode, of);
+            if (*err != 0) {
+                TRACE(TRACE_ERROR, "wfs_write: Failed to move inline data of '%s' to blocks", path);
+                inode_unlock(of->inode_num);
+                return 0;
+            }
+        }
     }
 
-    if (offset + size > inode.size) {
-        size = inode.size - offset;
+    off_t old_size = inode.size;
+    if (size > 0) {
+        *err = zero_eof_tail(&inode, of, offset);
     }
 
-    size_t bytes_read = 0;
-    while (size > 0) {
-        int block_index = offset / BLOCK_SIZE;
-        int block_offset = offset % BLOCK_SIZE;
+    // Blocks are allocated for the whole batch first; data is then copied in
+    // place, so full-block writes never read the old contents
+    while (size > 0 && *err == 0) {
+        if (offset / block_size >= max_file_blocks) {
+            // Past the largest file this image supports
+            TRACE(TRACE_ERROR, "wfs_write: Exceeds maximum file size for '%s'", path);
+            *err = -EFBIG;
+            break;
+        }
+        int first = offset / block_size;
+        size_t block_offset = offset % block_size;
+
+        int count = (block_offset + size + block_size - 1) / block_size;
+        if (count > EXTENT_BATCH) count = EXTENT_BATCH;
+        if (count > max_file_blocks - first) count = max_file_blocks - first;
+
+        // The rest of a hole the write only partly fills has to read as
+        // zeroes: before the write, and after it when that is inside the file
+        size_t batch_end = block_offset + size;
+        if (block_offset != 0) {
+            *err = zero_partial_hole(&inode, of, first);
+        }
+        if (*err == 0 && batch_end < (size_t) count * block_size && batch_end % block_size != 0 &&
+            offset + (off_t) size < old_size) {
+            *err = zero_partial_hole(&inode, of, first + batch_end / block_size);
+        }
+        if (*err != 0) {
+            TRACE(TRACE_ERROR, "wfs_write: Failed to allocate data block for '%s'", path);
+            break;
+        }
 
-        if (block_index < D_BLOCK) {
-            // Handle direct blocks
-            if (inode.blocks[block_index] == 0) {
-                fprintf(stderr, "[DEBUG] wfs_read: Direct block %d not allocated\n", block_index);
-                break;
-            }
+        off_t blocks[EXTENT_BATCH];
+        int mapped = map_file_blocks(&inode, of, first, count, blocks, MAP_ALLOC, err);
+        if (mapped == 0) {
+            TRACE(TRACE_ERROR, "wfs_write: Failed to allocate data block for '%s'", path);
+            break;
+        }
+
+        size_t to_write = (size_t) mapped * block_size - block_offset;
+        if (to_write > size) {
+            to_write = size;
+        }
+        copy_extents((char *) buf + bytes_written, blocks, mapped, block_offset, to_write, 1);
 
-            char block_buf[BLOCK_SIZE];
-            raid_read(block_buf, inode.blocks[block_index], BLOCK_SIZE);
+        size -= to_write;
+        offset += to_write;
+        bytes_written += to_write;
+        if (mapped < count) break;
+    }
 
-            size_t to_read = BLOCK_SIZE - block_offset;
-            if (to_read > size) {
-                to_read = size;
-            }
+    // Update inode size if necessary; a write that failed outright leaves
+    // it alone
+    if (bytes_written > 0 && offset > inode.size) {
+        TRACE(TRACE_DEBUG, "wfs_write: Updating inode %d size from %ld to %ld", inode.num, inode.size, offset);
+        inode.size = offset;
+    }
+    inode.mtim = inode.ctim = time(NULL);
+    store_inode(inode.num, &inode);
+    inode_unlock(of->inode_num);
+    TRACE(TRACE_DEBUG, "wfs_write: Updated inode %d's size to %ld", inode.num, inode.size);
+    return bytes_written;
+}
 
-            memcpy(buf + bytes_read, block_buf + block_offset, to_read);
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_write: Called with path='%s', size=%zu, offset=%ld", path, size, offset);
 
-            size -= to_read;
-            offset += to_read;
-            bytes_read += to_read;
+    struct wfs_open_file *of;
+    int res = resolve_open_file(path, fi, &of);
+    if (res != 0) {
+        TRACE(TRACE_DEBUG, "wfs_write error: traverse_path failed for path '%s' with error %d", path, res);
+        return res;
+    }
 
-        } else if (block_index < D_BLOCK + INDIRECT_BLOCK_ENTRIES) {
-            // Handle indirect blocks
-            int indirect_index = block_index - D_BLOCK;
+    size_t bytes_written = 0;
+    int err = 0, retries = 0;
+    do {
+        journal_begin();
+        bytes_written += write_range(of, path, buf + bytes_written, size - bytes_written, offset + bytes_written, &err);
+        journal_end();
+    } while (bytes_written < size && journal_should_retry(err, &retries));
+    release_open_file(fi, of);
+
+    TRACE(TRACE_DEBUG, "wfs_write: Wrote %zu bytes to '%s'", bytes_written, path);
+    if (bytes_written == 0 && err != 0) {
+        return err;
+    }
+    return bytes_written;
+}
 
-            if (inode.blocks[IND_BLOCK] == 0) {
-                fprintf(stderr, "[DEBUG] wfs_read: Indirect block not allocated\n");
-                break;
-            }
+// Allocates and zeroes the blocks of [offset, offset + length) under the
+// inode's write lock
+static int fallocate_range(struct wfs_open_file *of, int mode, off_t offset, off_t length) {
+    struct wfs_inode inode;
+    inode_wrlock(of->inode_num);
+    load_inode(of->inode_num, &inode);
 
-            // Read indirect pointers
-            off_t indirect_pointers[INDIRECT_BLOCK_ENTRIES];
-            res = read_indirect_pointers(&inode, indirect_pointers);
-            if (res != 0) {
-                break;
-            }
+    if ((inode.mode & S_IFREG) == 0) {
+        inode_unlock(of->inode_num);
+        return -EISDIR;
+    }
 
-            if (indirect_pointers[indirect_index] == 0) {
-                fprintf(stderr, "[DEBUG] wfs_read: Indirect data block %d not allocated\n", indirect_index);
-                break;
+    int first = offset / block_size;
+    int end = (offset + length + block_size - 1) / block_size;
+    int err = 0;
+    if (inode_is_inline(&inode)) {
+        if (offset + length <= (off_t) INLINE_MAX) {
+            // Inline bytes past the size are already zero
+            first = end;
+        } else {
+            err = inline_file_to_blocks(&inode, of);
+            if (err != 0) {
+                inode_unlock(of->inode_num);
+                return err;
             }
+        }
+    }
+    while (first < end) {
+        int count = end - first;
+        if (count > EXTENT_BATCH) count = EXTENT_BATCH;
+
+        off_t blocks[EXTENT_BATCH];
+        int mapped = map_file_blocks(&inode, of, first, count, blocks, MAP_ZERO, &err);
+        first += mapped;
+        if (mapped < count) break;
+    }
 
-            int data_block_num = indirect_pointers[indirect_index];
-            char data_block_buf[BLOCK_SIZE];
-            raid_read(data_block_buf, data_block_num, BLOCK_SIZE);
+    if (err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode.size) {
+        err = zero_eof_tail(&inode, of, offset + length);
+        if (err == 0) {
+            inode.size = offset + length;
+        }
+    }
+    inode.ctim = time(NULL);
+    store_inode(inode.num, &inode);
+    inode_unlock(of->inode_num);
+    return err;
+}
 
-            size_t to_read = BLOCK_SIZE - block_offset;
-            if (to_read > size) {
-                to_read = size;
-            }
+// Frees the blocks wholly inside [offset, offset + length) and zeroes the
+// rest of the range, under the inode's write lock. The size is unchanged.
+static int punch_range(struct wfs_open_file *of, off_t offset, off_t length) {
+    struct wfs_inode inode;
+    inode_wrlock(of->inode_num);
+    load_inode(of->inode_num, &inode);
 
-            memcpy(buf + bytes_read, data_block_buf + block_offset, to_read);
+    if ((inode.mode & S_IFREG) == 0) {
+        inode_unlock(of->inode_num);
+        return -EISDIR;
+    }
 
-            size -= to_read;
-            offset += to_read;
-            bytes_read += to_read;
+    off_t end = offset + length;
+    int err = 0;
+    if (inode_is_inline(&inode)) {
+        // Inline bytes past the size are already zero
+        if (end > inode.size) end = inode.size;
+        if (offset < end) {
+            inline_write(inode.num, NULL, offset, end - offset);
+        }
+    } else {
+        int first = (offset + block_size - 1) / block_size;
+        int last = end / block_size;
+        if (offset % block_size != 0) {
+            err = zero_block_range(&inode, of, offset, end < (off_t) first * block_size ? end : (off_t) first * block_size);
+        }
+        if (err == 0 && end % block_size != 0 && last >= first) {
+            err = zero_block_range(&inode, of, (off_t) last * block_size, end);
+        }
+        while (err == 0 && first < last) {
+            int count = last - first;
+            if (count > EXTENT_BATCH) count = EXTENT_BATCH;
 
-        } else {
-            // Exceeds supported blocks (direct + single indirect)
-            fprintf(stderr, "[ERROR] wfs_read: Exceeds maximum file size for '%s'\n", path);
-            return bytes_read; // Alternatively, return -EFBIG
+            off_t blocks[EXTENT_BATCH];
+            first += map_file_blocks(&inode, of, first, count, blocks, MAP_PUNCH, &err);
         }
     }
 
-    fprintf(stderr, "[DEBUG] wfs_read: Read %zu bytes from '%s'\n", bytes_read, path);
-    return bytes_read;
+    inode.mtim = inode.ctim = time(NULL);
+    store_inode(inode.num, &inode);
+    inode_unlock(of->inode_num);
+    return err;
 }
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) fi; // Unused parameter
-    fprintf(stderr, "[DEBUG] wfs_write: Called with path='%s', size=%zu, offset=%ld\n", path, size, offset);
+// Allocates zero-filled blocks for [offset, offset + length). The file size
+// grows to cover the range unless FALLOC_FL_KEEP_SIZE is given. With
+// FALLOC_FL_PUNCH_HOLE (which needs FALLOC_FL_KEEP_SIZE) the range becomes a
+// hole instead, and its blocks are freed.
+static int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_fallocate: Called with path='%s', mode=%d, offset=%ld, length=%ld", path, mode, offset, length);
 
-    struct wfs_inode inode;
-    int res = traverse_path(path, &inode, NULL);
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        return -EOPNOTSUPP;
+    }
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (offset + length > (off_t) max_file_blocks * block_size) {
+        return -EFBIG;
+    }
+
+    struct wfs_open_file *of;
+    int res = resolve_open_file(path, fi, &of);
     if (res != 0) {
-        fprintf(stderr, "[DEBUG] wfs_write error: traverse_path failed for path '%s' with error %d\n", path, res);
         return res;
     }
 
-    if ((inode.mode & S_IFREG) == 0) {
-        fprintf(stderr, "[ERROR] wfs_write: '%s' is not a regular file\n", path);
-        return -EISDIR;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        // A batch of blocks per operation, so a large hole cannot overrun
+        // one operation's share of the journal
+        off_t end = offset + length;
+        while (res == 0 && offset < end) {
+            off_t next = (offset / block_size + EXTENT_BATCH) * block_size;
+            if (next > end) next = end;
+            journal_begin();
+            res = punch_range(of, offset, next - offset);
+            journal_end();
+            offset = next;
+        }
+        release_open_file(fi, of);
+        return res;
     }
 
-    size_t bytes_written = 0;
-    while (size > 0) {
-        int block_index = offset / BLOCK_SIZE;
-        int block_offset = offset % BLOCK_SIZE;
-
-        if (block_index < D_BLOCK) {
-            // Handle direct blocks
-            if (inode.blocks[block_index] == 0) {
-                int block_num = allocate_data_block();
-                if (block_num < 0) {
-                    fprintf(stderr, "[ERROR] wfs_write: Failed to allocate data block for '%s'\n", path);
-                    break;
-                }
-                inode.blocks[block_index] = block_num;
-                fprintf(stderr, "[DEBUG] wfs_write: Allocated direct block %d for file inode %d\n", block_num, inode.num);
-            }
-
-            char block_buf[BLOCK_SIZE];
-            raid_read(block_buf, inode.blocks[block_index], BLOCK_SIZE);
-
-            size_t to_write = BLOCK_SIZE - block_offset;
-            if (to_write > size) {
-                to_write = size;
-            }
+    int retries = 0;
+    do {
+        journal_begin();
+        res = fallocate_range(of, mode, offset, length);
+        journal_end();
+    } while (journal_should_retry(res, &retries));
+    release_open_file(fi, of);
+    return res;
+}
 
-            memcpy(block_buf + block_offset, buf + bytes_written, to_write);
-            raid_write(block_buf, inode.blocks[block_index], BLOCK_SIZE);
+// Sets the file's size under the inode's write lock. Blocks past the new
+// end are freed; growing leaves the new range a hole.
+static int truncate_range(struct wfs_open_file *of, off_t size) {
+    struct wfs_inode inode;
+    inode_wrlock(of->inode_num);
+    load_inode(of->inode_num, &inode);
 
-            size -= to_write;
-            offset += to_write;
-            bytes_written += to_write;
+    if ((inode.mode & S_IFREG) == 0) {
+        inode_unlock(of->inode_num);
+        return -EISDIR;
+    }
 
-        } else if (block_index < D_BLOCK + INDIRECT_BLOCK_ENTRIES) {
-            // Handle indirect blocks
-            int indirect_index = block_index - D_BLOCK;
+    int err = 0;
+    if (size > inode.size) {
+        if (!inode_is_inline(&inode)) {
+            err = zero_eof_tail(&inode, of, size);
+        } else if (size > (off_t) INLINE_MAX) {
+            err = inline_file_to_blocks(&inode, of);
+        }
+    } else if (size < inode.size) {
+        if (inode_is_inline(&inode)) {
+            // Inline bytes past the size are kept zero
+            inline_write(inode.num, NULL, size, inode.size - size);
+        } else {
+            truncate_file_blocks(&inode, (size + block_size - 1) / block_size);
+        }
+    }
 
-            // Allocate the indirect block if not already allocated
-            res = allocate_indirect_block(&inode);
-            if (res != 0) {
-                fprintf(stderr, "[ERROR] wfs_write: Failed to allocate indirect block for '%s'\n", path);
-                break;
-            }
+    if (err == 0) {
+        TRACE(TRACE_DEBUG, "truncate_range: Inode %d size %ld -> %ld", inode.num, inode.size, size);
+        inode.size = size;
+        inode.mtim = inode.ctim = time(NULL);
+        store_inode(inode.num, &inode);
+    }
+    inode_unlock(of->inode_num);
+    return err;
+}
 
-            // Allocate the data block via indirect block
-            int data_block_num = allocate_indirect_data_block(&inode, indirect_index);
-            if (data_block_num < 0) {
-                fprintf(stderr, "[ERROR] wfs_write: Failed to allocate indirect data block for '%s' at indirect index %d\n", path, indirect_index);
-                break;
-            }
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    TRACE(TRACE_DEBUG, "wfs_ftruncate: Called with path='%s', size=%ld", path, size);
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
+    if (size < 0) {
+        return -EINVAL;
+    }
+    if (size > (off_t) max_file_blocks * block_size) {
+        return -EFBIG;
+    }
 
-            char data_block_buf[BLOCK_SIZE];
-            raid_read(data_block_buf, data_block_num, BLOCK_SIZE);
+    struct wfs_open_file *of;
+    int res = resolve_open_file(path, fi, &of);
+    if (res != 0) {
+        return res;
+    }
+    int retries = 0;
+    do {
+        journal_begin();
+        res = truncate_range(of, size);
+        journal_end();
+    } while (journal_should_retry(res, &retries));
+    release_open_file(fi, of);
+    return res;
+}
 
-            size_t to_write = BLOCK_SIZE - block_offset;
-            if (to_write > size) {
-                to_write = size;
-            }
+static int wfs_truncate(const char *path, off_t size) {
+    return wfs_ftruncate(path, size, NULL);
+}
 
-            memcpy(data_block_buf + block_offset, buf + bytes_written, to_write);
-            raid_write(data_block_buf, data_block_num, BLOCK_SIZE);
+// Everything written so far becomes durable: cached inodes are written
+// back, the running transaction is committed and the dirty pages of every
+// disk are written back. Only pages changed since the last write-back are
+// synced.
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void) path;
+    (void) datasync;
+    (void) fi;
+    icache_sync();
+    journal_commit();
+    return wb_sync();
+}
 
-            size -= to_write;
-            offset += to_write;
-            bytes_written += to_write;
+static int wfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    return wfs_fsync(path, datasync, fi);
+}
 
-        } else {
-            // Exceeds supported blocks (direct + single indirect)
-            fprintf(stderr, "[ERROR] wfs_write: Exceeds maximum file size for '%s'\n", path);
-            return -EFBIG;
-        }
+// Called on every close of a handle. Starts writing back in the background
+// rather than making close wait for the disks.
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    (void) fi;
+    if (__atomic_load_n(&wb_dirty_bytes, __ATOMIC_RELAXED) > 0) {
+        wb_kick();
     }
+    return 0;
+}
 
-    // Update inode size if necessary
-    if (offset > inode.size) {
-        fprintf(stderr, "[DEBUG] wfs_write: Updating inode %d size from %ld to %ld\n", inode.num, inode.size, offset);
-        inode.size = offset;
-    }
-    inode.mtim = inode.ctim = time(NULL);
-    store_inode(inode.num, &inode);
-    fprintf(stderr, "[DEBUG] wfs_write: Updated inode %d's size to %ld\n", inode.num, inode.size);
+struct readdir_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
 
-    fprintf(stderr, "[DEBUG] wfs_write: Wrote %zu bytes to '%s'\n", bytes_written, path);
-    return bytes_written;
+static int readdir_block(off_t block, struct wfs_dentry *entries, void *arg) {
+    (void) block;
+    struct readdir_ctx *ctx = arg;
+    int entries_per_block = block_size / sizeof(struct wfs_dentry);
+    for (int j = 0; j < entries_per_block; j++) {
+        if (strlen(entries[j].name) == 0) continue;
+        if (strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
+        ctx->filler(ctx->buf, entries[j].name, NULL, 0);
+        TRACE(TRACE_DEBUG, "wfs_readdir: Added entry '%s'", entries[j].name);
+    }
+    return 0;
 }
 
 static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi) {
     (void) offset;
     (void) fi;
-    fprintf(stderr, "[DEBUG] wfs_readdir: Called with path='%s'\n", path);
+    TRACE(TRACE_DEBUG, "wfs_readdir: Called with path='%s'", path);
 
     struct wfs_inode dir_inode;
-    int res = traverse_path(path, &dir_inode, NULL);
+    int dir_inode_num;
+    int res = traverse_path(path, NULL, &dir_inode_num);
     if (res != 0) {
-        fprintf(stderr, "[DEBUG] wfs_readdir error: traverse_path failed for path '%s' with error %d\n", path, res);
+        TRACE(TRACE_DEBUG, "wfs_readdir error: traverse_path failed for path '%s' with error %d", path, res);
         return res;
     }
 
+    inode_rdlock(dir_inode_num);
+    load_inode(dir_inode_num, &dir_inode);
     if ((dir_inode.mode & S_IFDIR) == 0) {
-        fprintf(stderr, "[ERROR] wfs_readdir: '%s' is not a directory\n", path);
+        TRACE(TRACE_DEBUG, "wfs_readdir: '%s' is not a directory", path);
+        inode_unlock(dir_inode_num);
         return -ENOTDIR;
     }
 
     // Add . and ..
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
-    fprintf(stderr, "[DEBUG] wfs_readdir: Added '.' and '..'\n");
+    TRACE(TRACE_DEBUG, "wfs_readdir: Added '.' and '..'");
 
-    int entries_per_block = BLOCK_SIZE / sizeof(struct wfs_dentry);
+    struct readdir_ctx ctx = { buf, filler };
+    dir_for_each_block(&dir_inode, readdir_block, &ctx);
 
-    for (int i = 0; i < N_BLOCKS; i++) {
-        if (dir_inode.blocks[i] == 0) continue;
-        char block_buf[BLOCK_SIZE];
-        raid_read(block_buf, dir_inode.blocks[i], BLOCK_SIZE);
-        struct wfs_dentry *entries = (struct wfs_dentry *)block_buf;
+    inode_unlock(dir_inode_num);
+    TRACE(TRACE_DEBUG, "wfs_readdir: Completed for path '%s'", path);
+    return 0;
+}
 
-        for (int j = 0; j < entries_per_block; j++) {
-            if (strlen(entries[j].name) == 0) continue;
-            if (strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
-            filler(buf, entries[j].name, NULL, 0);
-            fprintf(stderr, "[DEBUG] wfs_readdir: Added entry '%s'\n", entries[j].name);
-        }
-    }
+// Timed entry points, counted in op_stats
+static int timed_getattr(const char *path, struct stat *stbuf) {
+    uint64_t start = stat_clock();
+    int res = wfs_getattr(path, stbuf);
+    stat_op_done(OP_GETATTR, start);
+    return res;
+}
 
-    fprintf(stderr, "[DEBUG] wfs_readdir: Completed for path '%s'\n", path);
-    return 0;
+static int timed_mknod(const char *path, mode_t mode, dev_t dev) {
+    uint64_t start = stat_clock();
+    int res = wfs_mknod(path, mode, dev);
+    stat_op_done(OP_MKNOD, start);
+    return res;
+}
+
+static int timed_mkdir(const char *path, mode_t mode) {
+    uint64_t start = stat_clock();
+    int res = wfs_mkdir(path, mode);
+    stat_op_done(OP_MKDIR, start);
+    return res;
+}
+
+static int timed_unlink(const char *path) {
+    uint64_t start = stat_clock();
+    int res = wfs_unlink(path);
+    stat_op_done(OP_UNLINK, start);
+    return res;
+}
+
+static int timed_rmdir(const char *path) {
+    uint64_t start = stat_clock();
+    int res = wfs_rmdir(path);
+    stat_op_done(OP_RMDIR, start);
+    return res;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_read(path, buf, size, offset, fi);
+    stat_op_done(OP_READ, start);
+    return res;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_write(path, buf, size, offset, fi);
+    stat_op_done(OP_WRITE, start);
+    return res;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_readdir(path, buf, filler, offset, fi);
+    stat_op_done(OP_READDIR, start);
+    return res;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_open(path, fi);
+    stat_op_done(OP_OPEN, start);
+    return res;
+}
+
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_create(path, mode, fi);
+    stat_op_done(OP_CREATE, start);
+    return res;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_release(path, fi);
+    stat_op_done(OP_RELEASE, start);
+    return res;
+}
+
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_fallocate(path, mode, offset, length, fi);
+    stat_op_done(OP_FALLOCATE, start);
+    return res;
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_fsync(path, datasync, fi);
+    stat_op_done(OP_FSYNC, start);
+    return res;
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_flush(path, fi);
+    stat_op_done(OP_FLUSH, start);
+    return res;
+}
+
+static int timed_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_fsyncdir(path, datasync, fi);
+    stat_op_done(OP_FSYNCDIR, start);
+    return res;
+}
+
+static int timed_truncate(const char *path, off_t size) {
+    uint64_t start = stat_clock();
+    int res = wfs_truncate(path, size);
+    stat_op_done(OP_TRUNCATE, start);
+    return res;
+}
+
+static int timed_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    uint64_t start = stat_clock();
+    int res = wfs_ftruncate(path, size, fi);
+    stat_op_done(OP_FTRUNCATE, start);
+    return res;
+}
+
+static int timed_rename(const char *from, const char *to) {
+    uint64_t start = stat_clock();
+    int res = wfs_rename(from, to);
+    stat_op_done(OP_RENAME, start);
+    return res;
 }
 
 static const struct fuse_operations wfs_oper = {
     .init       = wfs_init,
-    .getattr    = wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .unlink     = wfs_unlink,
-    .rmdir      = wfs_rmdir,
-    .read       = wfs_read,
-    .write      = wfs_write,
-    .readdir    = wfs_readdir,
+    .getattr    = timed_getattr,
+    .mknod      = timed_mknod,
+    .mkdir      = timed_mkdir,
+    .unlink     = timed_unlink,
+    .rmdir      = timed_rmdir,
+    .rename     = timed_rename,
+    .read       = timed_read,
+    .write      = timed_write,
+    .readdir    = timed_readdir,
+    .open       = timed_open,
+    .create     = timed_create,
+    .release    = timed_release,
+    .fallocate  = timed_fallocate,
+    .fsync      = timed_fsync,
+    .flush      = timed_flush,
+    .fsyncdir   = timed_fsyncdir,
+    .truncate   = timed_truncate,
+    .ftruncate  = timed_ftruncate,
     .destroy    = NULL, 
 };
 
@@ -1191,7 +5233,7 @@ int map_disks_based_on_ids(char *disk_ids[MAX_DISKS], char *ordered_disk_maps[MA
     for (int i = 0; i < superblock.num_disks; i++) {
         int idx = find_disk_index_by_id(disk_ids[i]);
         if (idx == -1) {
-            fprintf(stderr, "[ERROR] map_disks_based_on_ids: Disk with ID '%s' not found in superblock's disk_order array.\n", disk_ids[i]);
+            TRACE(TRACE_ERROR, "map_disks_based_on_ids: Disk with ID '%s' not found in superblock's disk_order array.", disk_ids[i]);
             return -EINVAL;
         }
         ordered_disk_maps[i] = disk_maps[idx];
@@ -1202,14 +5244,123 @@ int map_disks_based_on_ids(char *disk_ids[MAX_DISKS], char *ordered_disk_maps[MA
 // Cleanup function
 static void wfs_destroy(void *private_data) {
     (void) private_data; // Unused parameter
-    fprintf(stderr, "[DEBUG] wfs_destroy: Called\n");
+    TRACE(TRACE_DEBUG, "wfs_destroy: Called");
+    icache_sync();
+    journal_stop();
+    wb_stop();
+    struct stats_snapshot *snap = stats_snapshot();
+    if (snap != NULL) {
+        for (char *line = snap->text; *line != '\0'; ) {
+            int len = strcspn(line, "\n");
+            TRACE(TRACE_INFO, "wfs_destroy: %.*s", len, line);
+            line += len + (line[len] == '\n');
+        }
+        stats_free(snap);
+    }
+    stripe_stop();
+    trace_stop();
 
     for (int i = 0; i < num_disks; i++) {
         munmap(disk_maps[i], fs_size);
-        close(fd_disks[i]);
-        fprintf(stderr, "[DEBUG] wfs_destroy: Unmapped and closed disk %d\n", i);
+        if (meta_maps[i] != NULL) {
+            munmap(meta_maps[i], superblock.d_blocks_ptr);
+        }
+        free(wb_pages[i]);
+        if (fd_disks[i] >= 0) {
+            close(fd_disks[i]);
+        }
+        TRACE(TRACE_DEBUG, "wfs_destroy: Unmapped and closed disk %d", i);
+    }
+    TRACE(TRACE_DEBUG, "wfs_destroy: Cleanup completed");
+}
+
+// Mount options, given as -o name=value after the disks
+struct wfs_options {
+    char *alloc;            // "contig" or "nextfit"
+    int prealloc;           // Blocks reserved ahead of each open file
+    int stripe_threads;     // Parallel copy workers, -1 for one per extra disk
+    char *read_policy;      // RAID 1 mirror choice: "rr", "lod" or "locality"
+    int commit_ms;          // Journal commit interval
+    unsigned long dirty_bytes; // Dirty data that wakes the flusher early
+    int trace;              // Trace level, see trace.h
+    char *trace_file;       // Where SIGUSR1 dumps the trace ring
+    int atime;              // ATIME_* from strictatime, relatime or noatime
+};
+
+static const struct fuse_opt wfs_opts[] = {
+    { "alloc=%s", offsetof(struct wfs_options, alloc), 0 },
+    { "prealloc=%d", offsetof(struct wfs_options, prealloc), 0 },
+    { "stripe_threads=%d", offsetof(struct wfs_options, stripe_threads), 0 },
+    { "read_policy=%s", offsetof(struct wfs_options, read_policy), 0 },
+    { "commit_ms=%d", offsetof(struct wfs_options, commit_ms), 0 },
+    { "dirty_bytes=%lu", offsetof(struct wfs_options, dirty_bytes), 0 },
+    { "trace=%d", offsetof(struct wfs_options, trace), 0 },
+    { "trace_file=%s", offsetof(struct wfs_options, trace_file), 0 },
+    { "strictatime", offsetof(struct wfs_options, atime), ATIME_STRICT },
+    { "relatime", offsetof(struct wfs_options, atime), ATIME_RELATIVE },
+    { "noatime", offsetof(struct wfs_options, atime), ATIME_NONE },
+    FUSE_OPT_END
+};
+
+// Applies the parsed mount options; returns -1 on an invalid value
+int apply_options(struct wfs_options *options) {
+    if (options->alloc != NULL) {
+        if (strcmp(options->alloc, "contig") == 0) {
+            alloc_policy = ALLOC_CONTIG;
+        } else if (strcmp(options->alloc, "nextfit") == 0) {
+            alloc_policy = ALLOC_NEXTFIT;
+        } else {
+            TRACE(TRACE_ERROR, "main: Unknown allocator '%s' (expected contig or nextfit).", options->alloc);
+            return -1;
+        }
+    }
+    if (options->prealloc < 0 || options->prealloc > INDIRECT_BLOCK_ENTRIES) {
+        TRACE(TRACE_ERROR, "main: prealloc must be between 0 and %d.", (int) INDIRECT_BLOCK_ENTRIES);
+        return -1;
+    }
+    prealloc_blocks = options->prealloc;
+    if (options->stripe_threads > MAX_DISKS) {
+        TRACE(TRACE_ERROR, "main: stripe_threads must be at most %d.", MAX_DISKS);
+        return -1;
+    }
+    stripe_threads = options->stripe_threads;
+    if (options->read_policy != NULL) {
+        if (strcmp(options->read_policy, "rr") == 0) {
+            read_policy = READ_ROUND_ROBIN;
+        } else if (strcmp(options->read_policy, "lod") == 0) {
+            read_policy = READ_LEAST_OUTSTANDING;
+        } else if (strcmp(options->read_policy, "locality") == 0) {
+            read_policy = READ_LOCALITY;
+        } else {
+            TRACE(TRACE_ERROR, "main: Unknown read policy '%s' (expected rr, lod or locality).", options->read_policy);
+            return -1;
+        }
+    }
+    if (options->commit_ms < 1 || options->commit_ms > 60000) {
+        TRACE(TRACE_ERROR, "main: commit_ms must be between 1 and 60000.");
+        return -1;
+    }
+    commit_interval_ms = options->commit_ms;
+    wb_dirty_limit = options->dirty_bytes;
+    if (options->trace < 0 || options->trace > TRACE_DEBUG) {
+        TRACE(TRACE_ERROR, "main: trace must be between 0 and %d.", TRACE_DEBUG);
+        return -1;
+    }
+    if (options->trace > WFS_TRACE_LEVEL) {
+        TRACE(TRACE_ERROR, "main: trace=%d is above the compiled-in level %d (rebuild with TRACE_LEVEL=%d).",
+              options->trace, WFS_TRACE_LEVEL, options->trace);
     }
-    fprintf(stderr, "[DEBUG] wfs_destroy: Cleanup completed\n");
+    trace_level = options->trace;
+    atime_mode = options->atime;
+    if (options->trace_file != NULL) {
+        // Opened now: FUSE changes to / when it daemonizes
+        trace_fd = open(options->trace_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (trace_fd < 0) {
+            TRACE(TRACE_ERROR, "main: Failed to open trace file '%s': %s", options->trace_file, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
 }
 
 // Main function
@@ -1226,98 +5377,190 @@ int main(int argc, char *argv[]) {
     }
 
     if (disk_argc == 0) {
-        fprintf(stderr, "[ERROR] main: No disks specified.\n");
+        TRACE(TRACE_ERROR, "main: No disks specified.");
         exit(EXIT_FAILURE);
     }
 
     num_disks = disk_argc;
     if (num_disks > MAX_DISKS) {
-        fprintf(stderr, "[ERROR] main: Too many disks specified. Max allowed is %d.\n", MAX_DISKS);
+        TRACE(TRACE_ERROR, "main: Too many disks specified. Max allowed is %d.", MAX_DISKS);
         exit(EXIT_FAILURE);
     }
 
     size_t superblock_size = sizeof(struct wfs_sb);
+    int have_superblock = 0;
     for (int i = 0; i < num_disks; i++) {
+        // A RAID 5 array may be mounted with one disk given as "missing"
+        if (strcmp(argv[i + 1], "missing") == 0) {
+            if (missing_disk >= 0) {
+                TRACE(TRACE_ERROR, "main: At most one disk can be missing.");
+                exit(EXIT_FAILURE);
+            }
+            missing_disk = i;
+            fd_disks[i] = -1;
+            continue;
+        }
+
         fd_disks[i] = open(argv[i + 1], O_RDWR);
         if (fd_disks[i] == -1) {
-            fprintf(stderr, "[ERROR] main: Failed to open disk '%s': %s\n", argv[i + 1], strerror(errno));
+            TRACE(TRACE_ERROR, "main: Failed to open disk '%s': %s", argv[i + 1], strerror(errno));
             exit(EXIT_FAILURE);
         }
-        // fprintf(stderr, "[DEBUG] main: Opened disk '%s'\n", argv[i + 1]);
 
         // Get file size
         struct stat st;
         if (fstat(fd_disks[i], &st) == -1) {
-            fprintf(stderr, "[ERROR] main: fstat failed for disk '%s': %s\n", argv[i + 1], strerror(errno));
+            TRACE(TRACE_ERROR, "main: fstat failed for disk '%s': %s", argv[i + 1], strerror(errno));
             exit(EXIT_FAILURE);
         }
 
         fs_size = st.st_size;
-        // fprintf(stderr, "[DEBUG] main: Disk '%s' size=%ld bytes\n", argv[i + 1], fs_size);
 
         disk_maps[i] = mmap(NULL, fs_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_disks[i], 0);
         if (disk_maps[i] == MAP_FAILED) {
-            fprintf(stderr, "[ERROR] main: mmap failed for disk '%s': %s\n", argv[i + 1], strerror(errno));
+            TRACE(TRACE_ERROR, "main: mmap failed for disk '%s': %s", argv[i + 1], strerror(errno));
             exit(EXIT_FAILURE);
         }
-        // fprintf(stderr, "[DEBUG] main: Mapped disk '%s' into memory\n", argv[i + 1]);
 
         // Read superblock from first disk
-        if (i == 0) {
-            memcpy(&superblock, disk_maps[0], superblock_size);
+        if (!have_superblock) {
+            have_superblock = 1;
+            memcpy(&superblock, disk_maps[i], superblock_size);
+            if (!(superblock.features & WFS_FEATURE_BLOCK_SIZE)) {
+                // Older layouts: the superblock ends before the block size,
+                // or before the journal fields
+                superblock_size = (superblock.features & WFS_FEATURE_JOURNAL) ? offsetof(struct wfs_sb, block_size)
+                                                                              : offsetof(struct wfs_sb, journal_ptr);
+                memset((char *) &superblock + superblock_size, 0, sizeof(struct wfs_sb) - superblock_size);
+                superblock.block_size = BLOCK_SIZE;
+            }
+            if (superblock.block_size < MIN_BLOCK_SIZE || superblock.block_size > MAX_BLOCK_SIZE ||
+                (superblock.block_size & (superblock.block_size - 1)) != 0) {
+                TRACE(TRACE_ERROR, "main: Unsupported block size %" PRIu64 ".", superblock.block_size);
+                exit(EXIT_FAILURE);
+            }
+            block_size = superblock.block_size;
+            ptrs_per_block = block_size / sizeof(off_t);
             raid_mode = superblock.raid_mode;
             num_inodes = superblock.num_inodes;
             num_data_blocks = superblock.num_data_blocks;
-            // fprintf(stderr, "[DEBUG] main: Loaded superblock from disk '%s'\n", argv[i + 1]);
-            // fprintf(stderr, "[DEBUG] main: raid_mode=%d, num_inodes=%" PRIu64 ", num_data_blocks=%" PRIu64 ", num_disks=%d\n",
-            //         raid_mode, num_inodes, num_data_blocks, superblock.num_disks);
-            //print_superblock();
+            stripe_blocks = superblock.stripe_blocks > 0 ? superblock.stripe_blocks : 1;
         } else {
             // Verify that superblocks are consistent across disks
             struct wfs_sb temp_sb;
             memcpy(&temp_sb, disk_maps[i], superblock_size);
             if (memcmp(&temp_sb, &superblock, superblock_size) != 0) {
-                fprintf(stderr, "[ERROR] main: Superblocks do not match across disks.\n");
+                TRACE(TRACE_ERROR, "main: Superblocks do not match across disks.");
                 exit(EXIT_FAILURE);
             }
-            // fprintf(stderr, "[DEBUG] main: Verified superblock consistency for disk '%s'\n", argv[i + 1]);
         }
     }
 
     // Verify number of disks
     if (num_disks != superblock.num_disks) {
-        fprintf(stderr, "[ERROR] main: Incorrect number of disks provided. Expected %d, got %d.\n", superblock.num_disks, num_disks);
+        TRACE(TRACE_ERROR, "main: Incorrect number of disks provided. Expected %d, got %d.", superblock.num_disks, num_disks);
+        exit(EXIT_FAILURE);
+    }
+
+    // Degraded RAID 5: an anonymous mapping stands in for the missing disk.
+    // It gets a copy of the metadata so metadata reads and updates work the
+    // same as with every disk present; its data blocks are never used.
+    if (missing_disk >= 0) {
+        if (raid_mode != 3) {
+            TRACE(TRACE_ERROR, "main: Only RAID 5 can be mounted with a missing disk.");
+            exit(EXIT_FAILURE);
+        }
+        disk_maps[missing_disk] = mmap(NULL, fs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (disk_maps[missing_disk] == MAP_FAILED) {
+            TRACE(TRACE_ERROR, "main: mmap failed for missing disk stand-in: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        memcpy(disk_maps[missing_disk], disk_maps[missing_disk == 0 ? 1 : 0], superblock.d_blocks_ptr);
+        TRACE(TRACE_INFO, "main: Running degraded without disk %d", missing_disk);
+    }
+    for (int i = 0; i < RAID5_STRIPE_LOCKS; i++) {
+        pthread_mutex_init(&raid5_locks[i], NULL);
+    }
+    if (fs_size < superblock.d_blocks_ptr +
+                  wfs_disk_data_blocks(num_data_blocks, raid_mode, num_disks, stripe_blocks) * block_size) {
+        TRACE(TRACE_ERROR, "main: Disk too small for its data blocks.");
+        exit(EXIT_FAILURE);
+    }
+
+    dir_index_enabled = (superblock.features & WFS_FEATURE_DIR_INDEX) != 0;
+    inline_enabled = (superblock.features & WFS_FEATURE_INLINE_DATA) != 0;
+    block_count_enabled = (superblock.features & WFS_FEATURE_BLOCK_COUNT) != 0;
+    // File blocks are numbered with ints
+    int64_t file_blocks = D_BLOCK + ptrs_per_block;
+    if (superblock.features & WFS_FEATURE_LARGE_FILE) {
+        file_blocks += (int64_t) ptrs_per_block * ptrs_per_block * (1 + ptrs_per_block);
+    }
+    max_file_blocks = file_blocks < INT_MAX ? file_blocks : INT_MAX;
+
+    // RAID 1v checksum region
+    crc32c_init();
+    if (raid_mode == 2 && (superblock.features & WFS_FEATURE_CSUM)) {
+        size_t csum_end = superblock.d_blocks_ptr + num_data_blocks * (block_size + sizeof(uint32_t));
+        if (fs_size < csum_end) {
+            TRACE(TRACE_ERROR, "main: Disk too small for its checksum region.");
+            exit(EXIT_FAILURE);
+        }
+        csum_enabled = 1;
+    }
+
+    // One reader/writer lock per inode
+    inode_locks = malloc(sizeof(pthread_rwlock_t) * num_inodes);
+    if (!inode_locks) {
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for inode locks.");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t i = 0; i < num_inodes; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    icache = calloc(num_inodes, sizeof(struct icache_entry *));
+    if (!icache) {
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for the inode cache.");
+        exit(EXIT_FAILURE);
+    }
+    dir_free_hint = calloc(num_inodes, sizeof(int));
+    if (!dir_free_hint) {
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for directory hints.");
+        exit(EXIT_FAILURE);
+    }
+    reserved_map = calloc((num_data_blocks + 7) / 8, 1);
+    if (!reserved_map) {
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for the reservation map.");
         exit(EXIT_FAILURE);
     }
-    // fprintf(stderr, "[DEBUG] main: Number of disks verified as %d\n", num_disks);
 
     // Read unique disk IDs from each disk's superblock
     char *disk_ids[MAX_DISKS];
     for (int i = 0; i < num_disks; i++) {
         disk_ids[i] = (char *)malloc(MAX_NAME * sizeof(char));
         if (!disk_ids[i]) {
-            fprintf(stderr, "[ERROR] main: Memory allocation failed for disk_ids[%d]\n", i);
+            TRACE(TRACE_ERROR, "main: Memory allocation failed for disk_ids[%d]", i);
             exit(EXIT_FAILURE);
         }
         // Assume that disk_order[i] contains the unique ID for disk i
         strncpy(disk_ids[i], disk_maps[i] + offsetof(struct wfs_sb, disk_order[i]), MAX_NAME);
         disk_ids[i][MAX_NAME - 1] = '\0'; // Ensure null-termination
-        // fprintf(stderr, "[DEBUG] main: Disk %d ID: %s\n", i, disk_ids[i]);
     }
 
     // Rearrange disk_maps based on disk_order in superblock
     char *ordered_disk_maps[MAX_DISKS];
+    int ordered_fds[MAX_DISKS];
     for (int i = 0; i < superblock.num_disks; i++) {
         int found = 0;
         for (int j = 0; j < num_disks; j++) {
             if (strncmp(superblock.disk_order[i], disk_ids[j], MAX_NAME) == 0) {
                 ordered_disk_maps[i] = disk_maps[j];
+                ordered_fds[i] = fd_disks[j];
                 found = 1;
                 break;
             }
         }
         if (!found) {
-            fprintf(stderr, "[ERROR] main: Disk with ID '%s' not found among provided disks.\n", superblock.disk_order[i]);
+            TRACE(TRACE_ERROR, "main: Disk with ID '%s' not found among provided disks.", superblock.disk_order[i]);
             exit(EXIT_FAILURE);
         }
     }
@@ -1325,6 +5568,7 @@ int main(int argc, char *argv[]) {
     // Assign ordered_disk_maps to disk_maps
     for (int i = 0; i < superblock.num_disks; i++) {
         disk_maps[i] = ordered_disk_maps[i];
+        fd_disks[i] = ordered_fds[i];
     }
 
     // Free allocated disk_ids
@@ -1332,13 +5576,22 @@ int main(int argc, char *argv[]) {
         free(disk_ids[i]);
     }
 
+    if (wb_setup() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Metadata journal: replay, then map the metadata privately
+    if ((superblock.features & WFS_FEATURE_JOURNAL) && journal_setup() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     // Prepare FUSE arguments
 
     // Create a new argv array for FUSE that includes the program name and FUSE options
     int fuse_argc = argc - disk_argc;
     char **fuse_argv = malloc(sizeof(char*) * fuse_argc);
     if (!fuse_argv) {
-        fprintf(stderr, "[ERROR] main: Memory allocation failed for fuse_argv.\n");
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for fuse_argv.");
         exit(EXIT_FAILURE);
     }
 
@@ -1348,15 +5601,19 @@ int main(int argc, char *argv[]) {
         fuse_argv[i] = argv[disk_argc + i];
     }
 
-    // Additional Debugging for Argument Parsing
-    // fprintf(stderr, "[DEBUG] main: Passing FUSE arguments: argc=%d\n", fuse_argc);
-    // for (int i = 0; i < fuse_argc; i++) {
-    //     fprintf(stderr, "[DEBUG] main: FUSE argv[%d] = '%s'\n", i, fuse_argv[i]);
-    // }
 
     // Ensure that there is at least one FUSE argument (the mount point)
     if (fuse_argc < 1) {
-        fprintf(stderr, "[ERROR] main: No mount point specified.\n");
+        TRACE(TRACE_ERROR, "main: No mount point specified.");
+        free(fuse_argv);
+        exit(EXIT_FAILURE);
+    }
+
+    // Pick out wfs's own -o options; the rest go to FUSE
+    struct fuse_args args = FUSE_ARGS_INIT(fuse_argc, fuse_argv);
+    struct wfs_options options = { NULL, prealloc_blocks, stripe_threads, NULL, commit_interval_ms, wb_dirty_limit,
+                                  trace_level, NULL, atime_mode };
+    if (fuse_opt_parse(&args, &options, wfs_opts, NULL) == -1 || apply_options(&options) != 0) {
         free(fuse_argv);
         exit(EXIT_FAILURE);
     }
@@ -1364,19 +5621,21 @@ int main(int argc, char *argv[]) {
     // Initialize FUSE operations structure
     struct fuse_operations *oper = malloc(sizeof(struct fuse_operations));
     if (!oper) {
-        fprintf(stderr, "[ERROR] main: Memory allocation failed for fuse_operations.\n");
+        TRACE(TRACE_ERROR, "main: Memory allocation failed for fuse_operations.");
         free(fuse_argv);
         exit(EXIT_FAILURE);
     }
     memset(oper, 0, sizeof(struct fuse_operations));
     *oper = wfs_oper;
     oper->destroy = wfs_destroy;
-    // fprintf(stderr, "[DEBUG] main: Initialized fuse_operations structure\n");
 
     // Initialize FUSE
-    int ret = fuse_main(fuse_argc, fuse_argv, oper, NULL);
-    // fprintf(stderr, "[DEBUG] main: fuse_main returned %d\n", ret);
+    int ret = fuse_main(args.argc, args.argv, oper, NULL);
 
+    fuse_opt_free_args(&args);
+    free(options.alloc);
+    free(options.read_policy);
+    free(options.trace_file);
     free(oper);
     free(fuse_argv);
     return ret;
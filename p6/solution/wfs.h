@@ -7,34 +7,70 @@
 #include <stdint.h>
 
 
+// Block size of images made without WFS_FEATURE_BLOCK_SIZE; newer images
+// record theirs in the superblock
 #define BLOCK_SIZE (512)
+#define MIN_BLOCK_SIZE (512)
+#define MAX_BLOCK_SIZE (64 * 1024)
 #define MAX_NAME   (28)
 #define MAX_DISKS 10
+#define INODE_SIZE (512)  // Bytes per inode slot
 
 
 #define D_BLOCK    (6)
 #define IND_BLOCK  (D_BLOCK+1)
 #define N_BLOCKS   (IND_BLOCK+1)
 
-#define INDIRECT_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(off_t)) // 64 entries
+#define INDIRECT_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(off_t)) // 64 entries at BLOCK_SIZE
 /*
   The fields in the superblock should reflect the structure of the filesystem.
   `mkfs` writes the superblock to offset 0 of the disk image. 
   The disk image will have this format:
 
-          d_bitmap_ptr       d_blocks_ptr
-               v                  v
-+----+---------+---------+--------+--------------------------+
-| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        |
-+----+---------+---------+--------+--------------------------+
+          d_bitmap_ptr       d_blocks_ptr               journal_ptr
+               v                  v                          v
++----+---------+---------+--------+--------------------------+---------+
+| SB | IBITMAP | DBITMAP | INODES |       DATA BLOCKS        | JOURNAL |
++----+---------+---------+--------+--------------------------+---------+
 0    ^                   ^
 i_bitmap_ptr        i_blocks_ptr
 
+  The journal only exists on images made with WFS_FEATURE_JOURNAL; on those
+  d_blocks_ptr is a multiple of WFS_META_ALIGN. RAID 1v checksums, when
+  present, sit between the data blocks and the journal. Data and journal
+  blocks are block_size bytes (BLOCK_SIZE on older images), and both
+  regions start on a multiple of it.
+
 */
 
 // Superblock
 #include <stdint.h>
 
+// Feature flags. Images made before a flag existed have it clear.
+#define WFS_FEATURE_CSUM 0x1   // RAID 1v: a uint32_t CRC32C per data block
+                               // follows the data blocks on every disk
+#define WFS_FEATURE_JOURNAL 0x2 // Metadata journal at journal_ptr on every disk
+#define WFS_FEATURE_DIR_INDEX 0x4 // Directories are hash-indexed (struct dx_node)
+#define WFS_FEATURE_LARGE_FILE 0x8 // Files may use dind_block and tind_block
+#define WFS_FEATURE_BLOCK_SIZE 0x10 // block_size is valid (otherwise BLOCK_SIZE)
+#define WFS_FEATURE_INLINE_DATA 0x20 // Inodes may hold their data, see WFS_INODE_INLINE
+#define WFS_FEATURE_BLOCK_COUNT 0x40 // Regular files keep nblocks up to date
+
+#define WFS_META_ALIGN 4096    // Metadata region size on journaled images
+
+// Blocks in each disk's data region. RAID 5 spreads the num_data_blocks
+// logical blocks over num_disks - 1 data units per stripe, so a disk holds
+// one unit slot per stripe (its data or the stripe's parity); the other
+// modes give every disk num_data_blocks slots.
+static inline uint64_t wfs_disk_data_blocks(uint64_t num_data_blocks, int raid_mode, int num_disks, int stripe_blocks) {
+    if (raid_mode != 3) {
+        return num_data_blocks;
+    }
+    uint64_t units = (num_data_blocks + stripe_blocks - 1) / stripe_blocks;
+    uint64_t stripes = (units + num_disks - 2) / (num_disks - 1);
+    return stripes * stripe_blocks;
+}
+
 struct wfs_sb {
     uint64_t num_inodes;       // 8 bytes
     uint64_t num_data_blocks;  // 8 bytes
@@ -45,9 +81,15 @@ struct wfs_sb {
     // Extend after this line
     int32_t raid_mode;         // 4 bytes
     int32_t num_disks;         // 4 bytes
-    // Add padding if necessary to align to 8-byte boundary
-    int32_t padding[2];        // 8 bytes total padding
+    int32_t stripe_blocks;     // 4 bytes, RAID 0 stripe unit in blocks (0 means 1)
+    int32_t features;          // 4 bytes, WFS_FEATURE_* flags (was padding)
     char disk_order[10][MAX_NAME]; 
+    // Only valid with WFS_FEATURE_JOURNAL; older images have their inode
+    // bitmap here
+    uint64_t journal_ptr;      // 8 bytes, byte offset of the journal
+    uint64_t journal_blocks;   // 8 bytes, journal size in blocks
+    // Only valid with WFS_FEATURE_BLOCK_SIZE
+    uint64_t block_size;       // 8 bytes, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
 };
 
 
@@ -65,12 +107,46 @@ struct wfs_inode {
     time_t ctim;      /* Time of last status change */
 
     off_t blocks[N_BLOCKS];
+
+    // Only used with WFS_FEATURE_LARGE_FILE; zero on older images
+    off_t dind_block; /* Double indirect block */
+    off_t tind_block; /* Triple indirect block */
+
+    // Only used with WFS_FEATURE_INLINE_DATA
+    uint32_t flags;   /* WFS_INODE_* flags */
+
+    // Only used with WFS_FEATURE_BLOCK_COUNT; was padding
+    uint32_t nblocks; /* Data blocks a regular file has allocated */
 };
 
+// The inode's contents live in the rest of its slot, right after struct
+// wfs_inode, instead of in data blocks. A file keeps its bytes there, a
+// directory an array of dentries; bytes past the contents are zero.
+#define WFS_INODE_INLINE 0x1
+#define INLINE_MAX (INODE_SIZE - sizeof(struct wfs_inode)) // 368 bytes
+
 // Directory entry
 struct wfs_dentry {
     char name[MAX_NAME];
     int num;
 };
 
+// Indexed directories (WFS_FEATURE_DIR_INDEX): blocks[0] is the first leaf
+// of dentries and blocks[IND_BLOCK], once the directory outgrows one leaf,
+// is the index root. Index entries are sorted by the lowest name hash
+// reachable through them. Index nodes take the first BLOCK_SIZE bytes of
+// their block whatever the image's block size.
+struct dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+#define DX_FANOUT ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct dx_entry)) // 63 entries
+
+struct dx_node {
+    uint32_t count;   // Entries in use
+    uint32_t depth;   // Root only: 0 if entries point at leaves, 1 if at index nodes
+    struct dx_entry entries[DX_FANOUT];
+};
+
 #endif // WFS_H
\ No newline at end of file
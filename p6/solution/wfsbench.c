@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Single-threaded metadata and data workloads against a mounted wfs.
+// Usage: ./wfsbench <mountpoint> <label> [scale]
+// Prints one CSV row per workload: label,workload,ops,seconds,ops_per_sec,
+// mb_per_sec (mb_per_sec is 0 for metadata workloads). Random offsets come
+// from a fixed seed, so every run issues the same requests. scale multiplies
+// the file counts and sizes below.
+
+#define FILES 1000           // create/stat/unlink storm
+#define SEQ_MB 16            // Sequential file size
+#define SEQ_IO (128 * 1024)
+#define RAND_IO 4096
+#define RAND_OPS 4000        // Random reads and writes, within the SEQ_MB file
+#define DEPTH 32             // Directories on the deep path
+#define DEEP_LOOKUPS 2000
+#define DIR_ENTRIES 500      // Entries in the listed directory
+#define LISTINGS 50
+
+static const char *mountpoint;
+static const char *label;
+static int scale = 1;
+static int status = 0;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *workload, long ops, double start, double bytes) {
+    double elapsed = now() - start;
+    printf("%s,%s,%ld,%.6f,%.1f,%.2f\n", label, workload, ops, elapsed, ops / elapsed,
+           bytes / (1024 * 1024) / elapsed);
+    fflush(stdout);
+}
+
+static void fail(const char *workload, const char *path) {
+    fprintf(stderr, "[ERROR] %s: %s: %s\n", workload, path, strerror(errno));
+    status = 1;
+}
+
+static void bench_files(void) {
+    char path[4096];
+    int files = FILES * scale;
+    struct stat st;
+    double start;
+
+    snprintf(path, sizeof(path), "%s/storm", mountpoint);
+    if (mkdir(path, 0755) != 0) {
+        fail("create", path);
+        return;
+    }
+
+    start = now();
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/storm/f%d", mountpoint, i);
+        int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) {
+            fail("create", path);
+            return;
+        }
+        close(fd);
+    }
+    report("create", files, start, 0);
+
+    start = now();
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/storm/f%d", mountpoint, i);
+        if (stat(path, &st) != 0) {
+            fail("stat", path);
+            return;
+        }
+    }
+    report("stat", files, start, 0);
+
+    start = now();
+    for (int i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/storm/f%d", mountpoint, i);
+        if (unlink(path) != 0) {
+            fail("unlink", path);
+            return;
+        }
+    }
+    report("unlink", files, start, 0);
+}
+
+static void bench_data(void) {
+    char path[4096];
+    static char buf[SEQ_IO];
+    off_t size = (off_t) SEQ_MB * scale * 1024 * 1024;
+    long chunks = size / SEQ_IO, blocks = size / RAND_IO, rand_ops = RAND_OPS * scale;
+    unsigned int seed = 537;
+    double start;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/data", mountpoint);
+    fd = open(path, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        fail("seq_write", path);
+        return;
+    }
+    memset(buf, 'b', sizeof(buf));
+
+    start = now();
+    for (long i = 0; i < chunks; i++) {
+        if (pwrite(fd, buf, SEQ_IO, i * SEQ_IO) != SEQ_IO) {
+            fail("seq_write", path);
+            goto out;
+        }
+    }
+    fsync(fd);
+    report("seq_write", chunks, start, size);
+
+    start = now();
+    for (long i = 0; i < chunks; i++) {
+        if (pread(fd, buf, SEQ_IO, i * SEQ_IO) != SEQ_IO) {
+            fail("seq_read", path);
+            goto out;
+        }
+    }
+    report("seq_read", chunks, start, size);
+
+    start = now();
+    for (long i = 0; i < rand_ops; i++) {
+        off_t off = (off_t)(rand_r(&seed) % blocks) * RAND_IO;
+        if (pwrite(fd, buf, RAND_IO, off) != RAND_IO) {
+            fail("rand_write", path);
+            goto out;
+        }
+    }
+    fsync(fd);
+    report("rand_write", rand_ops, start, (double) rand_ops * RAND_IO);
+
+    start = now();
+    for (long i = 0; i < rand_ops; i++) {
+        off_t off = (off_t)(rand_r(&seed) % blocks) * RAND_IO;
+        if (pread(fd, buf, RAND_IO, off) != RAND_IO) {
+            fail("rand_read", path);
+            goto out;
+        }
+    }
+    report("rand_read", rand_ops, start, (double) rand_ops * RAND_IO);
+
+out:
+    close(fd);
+    unlink(path);
+}
+
+// Lookups of a file DEPTH directories down, so every path component is
+// resolved on each stat
+static void bench_deep_path(void) {
+    char path[4096];
+    int len = snprintf(path, sizeof(path), "%s", mountpoint);
+    int lookups = DEEP_LOOKUPS * scale;
+    struct stat st;
+
+    for (int i = 0; i < DEPTH; i++) {
+        len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+        if (mkdir(path, 0755) != 0) {
+            fail("deep_path", path);
+            return;
+        }
+    }
+    snprintf(path + len, sizeof(path) - len, "/leaf");
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        fail("deep_path", path);
+        return;
+    }
+    close(fd);
+
+    double start = now();
+    for (int i = 0; i < lookups; i++) {
+        if (stat(path, &st) != 0) {
+            fail("deep_path", path);
+            return;
+        }
+    }
+    report("deep_path", lookups, start, 0);
+}
+
+static void bench_readdir(void) {
+    char path[4096];
+    int entries = DIR_ENTRIES * scale;
+    long seen = 0;
+
+    snprintf(path, sizeof(path), "%s/listing", mountpoint);
+    if (mkdir(path, 0755) != 0) {
+        fail("readdir", path);
+        return;
+    }
+    for (int i = 0; i < entries; i++) {
+        snprintf(path, sizeof(path), "%s/listing/entry%d", mountpoint, i);
+        if (mknod(path, S_IFREG | 0644, 0) != 0) {
+            fail("readdir", path);
+            return;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/listing", mountpoint);
+    double start = now();
+    for (int i = 0; i < LISTINGS; i++) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            fail("readdir", path);
+            return;
+        }
+        while (readdir(dir) != NULL) {
+            seen++;
+        }
+        closedir(dir);
+    }
+    report("readdir", seen, start, 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <mountpoint> <label> [scale]\n", argv[0]);
+        return 1;
+    }
+    mountpoint = argv[1];
+    label = argv[2];
+    if (argc > 3) scale = atoi(argv[3]);
+    if (scale < 1) {
+        fprintf(stderr, "[ERROR] main: scale must be >= 1\n");
+        return 1;
+    }
+
+    bench_files();
+    bench_data();
+    bench_deep_path();
+    bench_readdir();
+    return status;
+}
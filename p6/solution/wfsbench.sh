@@ -0,0 +1,43 @@
+#!/bin/bash
+# Usage: ./wfsbench.sh [output.csv] [scale]
+# Runs ./wfsbench on RAID 0, 1 and 1v and collects its CSV rows in output.csv
+# (default bench.csv). Each mode gets two fresh disks and a foreground mount
+# with direct_io, so reads and writes reach wfs rather than the page cache.
+
+OUT=${1:-bench.csv}
+SCALE=${2:-1}
+MNT=bench_mnt
+DISKS="bench_disk1 bench_disk2"
+
+mkdir -p $MNT
+echo "raid,workload,ops,seconds,ops_per_sec,mb_per_sec" > $OUT
+STATUS=0
+for RAID in 0 1 1v; do
+    MKFS_DISKS=""
+    for d in $DISKS; do
+        dd if=/dev/zero of=$d bs=1M count=$((48 * SCALE)) status=none
+        MKFS_DISKS="$MKFS_DISKS -d $d"
+    done
+    ./mkfs -r $RAID $MKFS_DISKS -i $((2048 * SCALE)) -b $((8192 * SCALE)) -B 4096 || exit 1
+
+    ./wfs $DISKS -f -o direct_io $MNT &
+    WFS_PID=$!
+    for i in $(seq 1 50); do
+        mountpoint -q $MNT && break
+        sleep 0.1
+    done
+    if ! mountpoint -q $MNT; then
+        echo "[ERROR] RAID $RAID: wfs did not mount" >&2
+        kill $WFS_PID 2>/dev/null
+        exit 1
+    fi
+
+    ./wfsbench $MNT $RAID $SCALE >> $OUT || STATUS=1
+    fusermount -u $MNT
+    wait $WFS_PID
+done
+
+rm -f $DISKS
+rmdir $MNT
+cat $OUT
+exit $STATUS